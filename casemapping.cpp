@@ -0,0 +1,154 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "casemapping.h"
+#include <IrcMessage>
+#include <IrcNetwork>
+#include <Irc>
+#include <QMutexLocker>
+#include <QMutex>
+#include <QHash>
+
+IRC_USE_NAMESPACE
+
+// IRC servers compare nicks bytewise with A-Z folded to a-z. The rfc1459
+// mappings additionally treat []\ (and ~ for the non-strict variant) as the
+// upper case forms of {}| (and ^).
+class FoldTable
+{
+public:
+    explicit FoldTable(CaseMapping::Type mapping)
+    {
+        for (int i = 0; i < 256; ++i)
+            table[i] = ushort(i);
+        for (int i = 'A'; i <= 'Z'; ++i)
+            table[i] = ushort(i + 'a' - 'A');
+        if (mapping != CaseMapping::Ascii) {
+            table[int('[')] = '{';
+            table[int(']')] = '}';
+            table[int('\\')] = '|';
+        }
+        if (mapping == CaseMapping::Rfc1459)
+            table[int('~')] = '^';
+    }
+
+    ushort table[256];
+};
+
+static const ushort* foldTable(CaseMapping::Type mapping)
+{
+    static const FoldTable ascii(CaseMapping::Ascii);
+    static const FoldTable rfc1459(CaseMapping::Rfc1459);
+    static const FoldTable strict(CaseMapping::StrictRfc1459);
+    switch (mapping) {
+        case CaseMapping::Ascii: return ascii.table;
+        case CaseMapping::StrictRfc1459: return strict.table;
+        default: return rfc1459.table;
+    }
+}
+
+// the CASEMAPPING each network has announced, forgotten with the network
+struct NetworkMappings
+{
+    QMutex mutex;
+    QHash<QObject*, int> mappings;
+};
+
+Q_GLOBAL_STATIC(NetworkMappings, networkMappings)
+
+static void forgetNetwork(QObject* network)
+{
+    NetworkMappings* networks = networkMappings();
+    if (networks) {
+        QMutexLocker locker(&networks->mutex);
+        networks->mappings.remove(network);
+    }
+}
+
+CaseMapping::Type CaseMapping::fromName(const QString& name)
+{
+    if (name.compare(QLatin1String("ascii"), Qt::CaseInsensitive) == 0)
+        return Ascii;
+    if (name.compare(QLatin1String("strict-rfc1459"), Qt::CaseInsensitive) == 0)
+        return StrictRfc1459;
+    return Rfc1459;
+}
+
+// Picks CASEMAPPING from RPL_ISUPPORT. Returns false for any other message.
+// The value is also remembered for the network, so that anything attached
+// after registration can look it up with fromNetwork().
+bool CaseMapping::fromMessage(IrcMessage* message, Type* type)
+{
+    if (message->type() != IrcMessage::Numeric || static_cast<IrcNumericMessage*>(message)->code() != Irc::RPL_ISUPPORT)
+        return false;
+
+    foreach (const QString& param, message->parameters()) {
+        if (param.startsWith(QLatin1String("CASEMAPPING="), Qt::CaseInsensitive)) {
+            *type = fromName(param.mid(12));
+            IrcNetwork* network = message->network();
+            if (network) {
+                NetworkMappings* networks = networkMappings();
+                QMutexLocker locker(&networks->mutex);
+                if (!networks->mappings.contains(network))
+                    QObject::connect(network, &QObject::destroyed, forgetNetwork);
+                networks->mappings.insert(network, *type);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// IrcNetwork does not expose CASEMAPPING itself. Returns false until a
+// RPL_ISUPPORT carrying it has gone through fromMessage().
+bool CaseMapping::fromNetwork(IrcNetwork* network, Type* type)
+{
+    if (!network)
+        return false;
+
+    NetworkMappings* networks = networkMappings();
+    QMutexLocker locker(&networks->mutex);
+    QHash<QObject*, int>::const_iterator it = networks->mappings.constFind(network);
+    if (it == networks->mappings.constEnd())
+        return false;
+
+    *type = Type(it.value());
+    return true;
+}
+
+// Characters beyond Latin-1 are left as they are, just like servers do.
+QString CaseMapping::fold(const QString& str, Type type)
+{
+    const ushort* table = foldTable(type);
+    QString result(str.length(), Qt::Uninitialized);
+    const ushort* src = str.utf16();
+    ushort* dst = reinterpret_cast<ushort*>(result.data());
+    for (int i = 0; i < str.length(); ++i)
+        dst[i] = src[i] < 256 ? table[src[i]] : src[i];
+    return result;
+}
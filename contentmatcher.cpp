@@ -0,0 +1,194 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "contentmatcher.h"
+
+ContentMatcher::ContentMatcher()
+{
+    d.dirty = false;
+    d.allTypes = 0;
+}
+
+bool ContentMatcher::isEmpty() const
+{
+    return d.patterns.isEmpty();
+}
+
+uint ContentMatcher::types() const
+{
+    return d.allTypes;
+}
+
+QStringList ContentMatcher::patterns() const
+{
+    return d.patterns;
+}
+
+uint ContentMatcher::types(const QString& pattern) const
+{
+    const int index = d.indexes.value(pattern, -1);
+    return index != -1 ? d.types.at(index) : 0;
+}
+
+// Changes only mark the automaton out of date, so loading many rules
+// costs one build on the next match() or build() instead of one each.
+bool ContentMatcher::insert(const QString& pattern, uint types)
+{
+    if (pattern.isEmpty() || !types)
+        return false;
+
+    const int index = d.indexes.value(pattern, -1);
+    if (index != -1) {
+        if (d.types.at(index) == types)
+            return false;
+        d.types[index] = types;
+        updateTypes();
+    } else {
+        d.indexes.insert(pattern, d.patterns.count());
+        d.patterns += pattern;
+        d.types += types;
+        d.allTypes |= types;
+    }
+    d.dirty = true;
+    return true;
+}
+
+bool ContentMatcher::remove(const QString& pattern)
+{
+    const int index = d.indexes.value(pattern, -1);
+    if (index == -1)
+        return false;
+
+    d.patterns.removeAt(index);
+    d.types.remove(index);
+    d.indexes.remove(pattern);
+    for (int i = index; i < d.patterns.count(); ++i)
+        d.indexes[d.patterns.at(i)] = i;
+    updateTypes();
+    d.dirty = true;
+    return true;
+}
+
+void ContentMatcher::clear()
+{
+    d.patterns.clear();
+    d.types.clear();
+    d.indexes.clear();
+    d.nodes.clear();
+    d.dirty = false;
+    d.allTypes = 0;
+}
+
+// Scans the text once, whatever the number of patterns. Returns the
+// first pattern found that applies to the given type bit. Matching
+// builds an out of date automaton first, so a matcher that is shared
+// between threads must be built before it is shared.
+QString ContentMatcher::match(const QString& text, uint type) const
+{
+    if (!(d.allTypes & type))
+        return QString();
+    build();
+
+    const QString folded = text.toCaseFolded();
+    const ushort* data = folded.utf16();
+    const Node* nodes = d.nodes.constData();
+
+    int state = 0;
+    for (int i = 0; i < folded.length(); ++i) {
+        int next = -1;
+        while ((next = nodes[state].next.value(data[i], -1)) == -1 && state)
+            state = nodes[state].fail;
+        state = qMax(0, next);
+
+        if (nodes[state].types & type) {
+            foreach (int output, nodes[state].outputs) {
+                if (d.types.at(output) & type)
+                    return d.patterns.at(output);
+            }
+        }
+    }
+    return QString();
+}
+
+void ContentMatcher::updateTypes()
+{
+    d.allTypes = 0;
+    foreach (uint types, d.types)
+        d.allTypes |= types;
+}
+
+void ContentMatcher::build() const
+{
+    if (!d.dirty)
+        return;
+    d.dirty = false;
+    d.nodes.clear();
+    d.nodes.append(Node());
+
+    // trie of the folded patterns
+    for (int i = 0; i < d.patterns.count(); ++i) {
+        const QString pattern = d.patterns.at(i).toCaseFolded();
+        int state = 0;
+        foreach (const QChar& c, pattern) {
+            int next = d.nodes.at(state).next.value(c.unicode(), -1);
+            if (next == -1) {
+                next = d.nodes.count();
+                d.nodes.append(Node());
+                d.nodes[state].next.insert(c.unicode(), next);
+            }
+            state = next;
+        }
+        d.nodes[state].outputs += i;
+        d.nodes[state].types |= d.types.at(i);
+    }
+
+    // failure links in breadth-first order, so that the failure target
+    // of a node is complete before the node itself is visited
+    QVector<int> queue;
+    foreach (int child, d.nodes.at(0).next)
+        queue += child;
+    for (int head = 0; head < queue.count(); ++head) {
+        const int state = queue.at(head);
+        QHashIterator<ushort, int> it(d.nodes.at(state).next);
+        while (it.hasNext()) {
+            it.next();
+            const int child = it.value();
+            int fail = d.nodes.at(state).fail;
+            int target = -1;
+            while ((target = d.nodes.at(fail).next.value(it.key(), -1)) == -1 && fail)
+                fail = d.nodes.at(fail).fail;
+            target = qMax(0, target);
+
+            Node& node = d.nodes[child];
+            node.fail = target;
+            node.outputs += d.nodes.at(target).outputs;
+            node.types |= d.nodes.at(target).types;
+            queue += child;
+        }
+    }
+}
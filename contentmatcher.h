@@ -0,0 +1,78 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CONTENTMATCHER_H
+#define CONTENTMATCHER_H
+
+#include <QHash>
+#include <QVector>
+#include <QStringList>
+#include "sharedglobal.h"
+
+class SHARED_EXPORT ContentMatcher
+{
+public:
+    ContentMatcher();
+
+    bool isEmpty() const;
+    uint types() const;
+
+    QStringList patterns() const;
+    uint types(const QString& pattern) const;
+
+    bool insert(const QString& pattern, uint types);
+    bool remove(const QString& pattern);
+    void clear();
+
+    QString match(const QString& text, uint type) const;
+    void build() const;
+
+private:
+    void updateTypes();
+
+    // Aho-Corasick automaton over folded UTF-16 code units; the outputs
+    // of a node include those reachable through its failure links
+    struct Node {
+        Node() : fail(0), types(0) { }
+        QHash<ushort, int> next;
+        int fail;
+        uint types;
+        QVector<int> outputs;
+    };
+
+    mutable struct Private {
+        QStringList patterns;
+        QVector<uint> types;
+        QHash<QString, int> indexes;
+        QVector<Node> nodes;
+        bool dirty;
+        uint allTypes;
+    } d;
+};
+
+#endif // CONTENTMATCHER_H
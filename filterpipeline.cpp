@@ -0,0 +1,180 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "filterpipeline.h"
+#include <QElapsedTimer>
+#include <ircconnection.h>
+#include <ircmessage.h>
+
+IRC_USE_NAMESPACE
+
+// Runs its stages in order and stops at the first stage that drops the
+// message. A stage is only called for the message types in its mask.
+// The stages are set up from the thread of the connection; the
+// statistics may be read from anywhere.
+FilterPipeline::FilterPipeline(QObject* parent) : QObject(parent)
+{
+    d.types = 0;
+}
+
+FilterPipeline::~FilterPipeline()
+{
+    qDeleteAll(d.stages);
+}
+
+// Returns the pipeline of the connection, installing one on first use.
+// Filters that share a connection go through it, so that each of them
+// runs exactly once per message and in a well defined order.
+FilterPipeline* FilterPipeline::forConnection(IrcConnection* connection)
+{
+    if (!connection)
+        return 0;
+
+    FilterPipeline* pipeline = connection->findChild<FilterPipeline*>(QString(), Qt::FindDirectChildrenOnly);
+    if (!pipeline) {
+        pipeline = new FilterPipeline(connection);
+        connection->installMessageFilter(pipeline);
+    }
+    return pipeline;
+}
+
+bool FilterPipeline::messageFilter(IrcMessage* message)
+{
+    const uint type = 1u << message->type();
+    if (!(d.types & type))
+        return false;
+
+    QElapsedTimer timer;
+    foreach (Stage* stage, d.stages) {
+        if (!(stage->types & type))
+            continue;
+
+        timer.start();
+        const bool dropped = stage->filter->messageFilter(message);
+        stage->nsecs.fetchAndAddRelaxed(timer.nsecsElapsed());
+        if (dropped) {
+            stage->dropped.fetchAndAddRelaxed(1);
+            return true;
+        }
+        stage->passed.fetchAndAddRelaxed(1);
+    }
+    return false;
+}
+
+QStringList FilterPipeline::stages() const
+{
+    QStringList names;
+    foreach (const Stage* stage, d.stages)
+        names += stage->name;
+    return names;
+}
+
+bool FilterPipeline::contains(IrcMessageFilter* filter) const
+{
+    foreach (const Stage* stage, d.stages) {
+        if (stage->filter == filter)
+            return true;
+    }
+    return false;
+}
+
+uint FilterPipeline::stageTypes(const QString& name) const
+{
+    const Stage* s = stage(name);
+    return s ? s->types : 0;
+}
+
+void FilterPipeline::addStage(const QString& name, IrcMessageFilter* filter, uint types)
+{
+    insertStage(d.stages.count(), name, filter, types);
+}
+
+// A filter is a stage of the pipeline at most once.
+void FilterPipeline::insertStage(int index, const QString& name, IrcMessageFilter* filter, uint types)
+{
+    if (!filter || contains(filter))
+        return;
+
+    Stage* stage = new Stage;
+    stage->name = name;
+    stage->filter = filter;
+    stage->types = types;
+    stage->nsecs = 0;
+    stage->dropped = 0;
+    stage->passed = 0;
+    d.stages.insert(qBound(0, index, d.stages.count()), stage);
+    d.types |= types;
+}
+
+void FilterPipeline::removeStage(IrcMessageFilter* filter)
+{
+    d.types = 0;
+    for (int i = d.stages.count() - 1; i >= 0; --i) {
+        if (d.stages.at(i)->filter == filter)
+            delete d.stages.takeAt(i);
+        else
+            d.types |= d.stages.at(i)->types;
+    }
+}
+
+// Returns the nanoseconds spent in the stage.
+qint64 FilterPipeline::stageTime(const QString& name) const
+{
+    const Stage* s = stage(name);
+    return s ? s->nsecs.loadAcquire() : 0;
+}
+
+qint64 FilterPipeline::stageDropped(const QString& name) const
+{
+    const Stage* s = stage(name);
+    return s ? s->dropped.loadAcquire() : 0;
+}
+
+qint64 FilterPipeline::stagePassed(const QString& name) const
+{
+    const Stage* s = stage(name);
+    return s ? s->passed.loadAcquire() : 0;
+}
+
+void FilterPipeline::resetStatistics()
+{
+    foreach (Stage* stage, d.stages) {
+        stage->nsecs.storeRelease(0);
+        stage->dropped.storeRelease(0);
+        stage->passed.storeRelease(0);
+    }
+}
+
+const FilterPipeline::Stage* FilterPipeline::stage(const QString& name) const
+{
+    foreach (const Stage* stage, d.stages) {
+        if (stage->name == name)
+            return stage;
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef FILTERPIPELINE_H
+#define FILTERPIPELINE_H
+
+#include <QObject>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QAtomicInteger>
+#include <IrcMessageFilter>
+#include "sharedglobal.h"
+
+IRC_FORWARD_DECLARE_CLASS(IrcMessage)
+IRC_FORWARD_DECLARE_CLASS(IrcConnection)
+
+class SHARED_EXPORT FilterPipeline : public QObject, public IrcMessageFilter
+{
+    Q_OBJECT
+    Q_INTERFACES(IrcMessageFilter)
+
+public:
+    // stage types are bitmasks of (1 << IrcMessage::Type)
+    enum { AllTypes = 0xffffffff };
+
+    explicit FilterPipeline(QObject* parent = 0);
+    virtual ~FilterPipeline();
+
+    static FilterPipeline* forConnection(IrcConnection* connection);
+
+    bool messageFilter(IrcMessage* message);
+
+    QStringList stages() const;
+    bool contains(IrcMessageFilter* filter) const;
+    uint stageTypes(const QString& name) const;
+
+    void addStage(const QString& name, IrcMessageFilter* filter, uint types = AllTypes);
+    void insertStage(int index, const QString& name, IrcMessageFilter* filter, uint types = AllTypes);
+    void removeStage(IrcMessageFilter* filter);
+
+    qint64 stageTime(const QString& name) const;
+    qint64 stageDropped(const QString& name) const;
+    qint64 stagePassed(const QString& name) const;
+    void resetStatistics();
+
+private:
+    struct Stage {
+        QString name;
+        IrcMessageFilter* filter;
+        uint types;
+        QAtomicInteger<qint64> nsecs;
+        QAtomicInteger<qint64> dropped;
+        QAtomicInteger<qint64> passed;
+    };
+
+    const Stage* stage(const QString& name) const;
+
+    struct Private {
+        QList<Stage*> stages;
+        uint types;
+    } d;
+};
+
+#endif // FILTERPIPELINE_H
@@ -0,0 +1,204 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "floodmanager.h"
+#include "sharedtimer.h"
+#include "filterpipeline.h"
+#include <ircconnection.h>
+#include <ircmessage.h>
+
+IRC_USE_NAMESPACE
+
+FloodManager::FloodManager(QObject* parent) : QObject(parent)
+{
+    d.interval = 5000;
+    d.prefixThreshold = 20;
+    d.hostThreshold = 40;
+    d.clock.start();
+    clear(d.prefixes);
+    clear(d.hosts);
+}
+
+FloodManager::~FloodManager()
+{
+}
+
+// Joins, parts, quits and nick changes count towards a flood but are
+// never shed, because libcommuni keeps its channel and user state from
+// them. Only the private messages and notices of a flooding source are.
+bool FloodManager::messageFilter(IrcMessage* message)
+{
+    switch (message->type()) {
+        case IrcMessage::Private:
+        case IrcMessage::Notice:
+        case IrcMessage::Join:
+        case IrcMessage::Part:
+        case IrcMessage::Quit:
+        case IrcMessage::Nick:
+            break;
+        default:
+            return false;
+    }
+    if (message->flags() & (IrcMessage::Own | IrcMessage::Playback))
+        return false;
+
+    const qint64 now = d.clock.elapsed();
+    const QString prefix = message->prefix();
+    QString source;
+    if (exceeds(d.prefixes, prefix, d.prefixThreshold, now))
+        source = prefix;
+    else if (exceeds(d.hosts, message->host(), d.hostThreshold, now))
+        source = "*!*@" + message->host();
+    if (source.isNull())
+        return false;
+    if (message->type() != IrcMessage::Private && message->type() != IrcMessage::Notice)
+        return false;
+
+    // shed messages are collapsed into one report per source and tick
+    if (d.shed.isEmpty())
+        SharedTimer::instance()->registerReceiver(this, "reportShed");
+    ++d.shed[source];
+    return true;
+}
+
+int FloodManager::interval() const
+{
+    return d.interval;
+}
+
+void FloodManager::setInterval(int interval)
+{
+    if (d.interval != interval) {
+        d.interval = qMax(1, interval);
+        clear(d.prefixes);
+        clear(d.hosts);
+    }
+}
+
+int FloodManager::prefixThreshold() const
+{
+    return d.prefixThreshold;
+}
+
+void FloodManager::setPrefixThreshold(int threshold)
+{
+    d.prefixThreshold = threshold;
+}
+
+int FloodManager::hostThreshold() const
+{
+    return d.hostThreshold;
+}
+
+void FloodManager::setHostThreshold(int threshold)
+{
+    d.hostThreshold = threshold;
+}
+
+void FloodManager::addConnection(IrcConnection* connection)
+{
+    const uint types = (1 << IrcMessage::Private) | (1 << IrcMessage::Notice) | (1 << IrcMessage::Join)
+                     | (1 << IrcMessage::Part) | (1 << IrcMessage::Quit) | (1 << IrcMessage::Nick);
+    FilterPipeline::forConnection(connection)->addStage("flood", this, types);
+}
+
+void FloodManager::removeConnection(IrcConnection* connection)
+{
+    FilterPipeline::forConnection(connection)->removeStage(this);
+}
+
+void FloodManager::reportShed()
+{
+    const QHash<QString, int> shed = d.shed;
+    d.shed.clear();
+    SharedTimer::instance()->unregisterReceiver(this, "reportShed");
+
+    QHashIterator<QString, int> it(shed);
+    while (it.hasNext()) {
+        it.next();
+        emit messagesShed(it.key(), it.value());
+    }
+}
+
+void FloodManager::clear(Counter* table)
+{
+    for (int i = 0; i < TableSize; ++i) {
+        table[i].key = 0;
+        table[i].source.clear();
+        table[i].window = 0;
+        table[i].previous = 0;
+        table[i].current = 0;
+    }
+}
+
+// Open addressing over a fixed table. Free and stale slots do not end
+// the probe sequence, so the whole sequence is searched for the source
+// before a slot is taken: the first free or stale one, or else the one
+// that has been idle the longest.
+FloodManager::Counter* FloodManager::counter(Counter* table, const QString& source, qint64 window)
+{
+    const uint key = qHash(source) | 1;
+    Counter* victim = 0;
+    qint64 age = 0;
+    for (int i = 0; i < MaxProbes; ++i) {
+        Counter* c = &table[(key + i) % TableSize];
+        if (c->key == key && c->source == source)
+            return c;
+        const qint64 last = !c->key || c->window < window - 1 ? -1 : c->window;
+        if (!victim || last < age) {
+            victim = c;
+            age = last;
+        }
+    }
+    victim->key = key;
+    victim->source = source;
+    victim->window = window;
+    victim->previous = 0;
+    victim->current = 0;
+    return victim;
+}
+
+bool FloodManager::exceeds(Counter* table, const QString& source, int threshold, qint64 now)
+{
+    if (source.isEmpty() || threshold <= 0)
+        return false;
+
+    const qint64 window = now / d.interval;
+    Counter* c = counter(table, source, window);
+    if (c->window != window) {
+        c->previous = c->window == window - 1 ? c->current : 0;
+        c->current = 0;
+        c->window = window;
+    }
+    ++c->current;
+
+    // weigh the previous window by how much of it the sliding window still covers
+    const qint64 elapsed = now % d.interval;
+    const qint64 estimate = c->previous * (d.interval - elapsed) / d.interval + c->current;
+    return estimate > threshold;
+}
@@ -0,0 +1,102 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef FLOODMANAGER_H
+#define FLOODMANAGER_H
+
+#include <QObject>
+#include <QHash>
+#include <QElapsedTimer>
+#include <IrcMessageFilter>
+#include "sharedglobal.h"
+
+IRC_FORWARD_DECLARE_CLASS(IrcMessage)
+IRC_FORWARD_DECLARE_CLASS(IrcConnection)
+
+class SHARED_EXPORT FloodManager : public QObject, public IrcMessageFilter
+{
+    Q_OBJECT
+    Q_INTERFACES(IrcMessageFilter)
+    Q_PROPERTY(int interval READ interval WRITE setInterval)
+    Q_PROPERTY(int prefixThreshold READ prefixThreshold WRITE setPrefixThreshold)
+    Q_PROPERTY(int hostThreshold READ hostThreshold WRITE setHostThreshold)
+
+public:
+    explicit FloodManager(QObject* parent = 0);
+    virtual ~FloodManager();
+
+    bool messageFilter(IrcMessage* message);
+
+    int interval() const;
+    void setInterval(int interval);
+
+    int prefixThreshold() const;
+    void setPrefixThreshold(int threshold);
+
+    int hostThreshold() const;
+    void setHostThreshold(int threshold);
+
+public slots:
+    void addConnection(IrcConnection* connection);
+    void removeConnection(IrcConnection* connection);
+
+signals:
+    void messagesShed(const QString& source, int count);
+
+private slots:
+    void reportShed();
+
+private:
+    // sliding window counter approximated from the previous and the
+    // current fixed window; a zero key marks a free slot, the source
+    // tells apart sources whose hashes collide
+    struct Counter {
+        uint key;
+        QString source;
+        qint64 window;
+        int previous;
+        int current;
+    };
+    enum { TableSize = 1024, MaxProbes = 8 };
+
+    static void clear(Counter* table);
+    Counter* counter(Counter* table, const QString& source, qint64 window);
+    bool exceeds(Counter* table, const QString& source, int threshold, qint64 now);
+
+    struct Private {
+        int interval;
+        int prefixThreshold;
+        int hostThreshold;
+        QElapsedTimer clock;
+        Counter prefixes[TableSize];
+        Counter hosts[TableSize];
+        QHash<QString, int> shed;
+    } d;
+};
+
+#endif // FLOODMANAGER_H
@@ -0,0 +1,525 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ignoreindex.h"
+#include <QHostAddress>
+#include <QPair>
+#include <string.h>
+#include <algorithm>
+
+// IRC masks know only two wildcards: '*' matches any sequence and '?'
+// matches any single character. Backtracks to the last '*' on mismatch,
+// so the worst case stays linear in the pattern times the subject length.
+static bool wildcardMatch(const QString& pattern, const QString& str)
+{
+    const QChar* p = pattern.constData();
+    const QChar* pe = p + pattern.length();
+    const QChar* s = str.constData();
+    const QChar* se = s + str.length();
+    const QChar* star = 0;
+    const QChar* mark = 0;
+
+    while (s != se) {
+        if (p != pe && (*p == QLatin1Char('?') || *p == *s)) {
+            ++p;
+            ++s;
+        } else if (p != pe && *p == QLatin1Char('*')) {
+            star = ++p;
+            mark = s;
+        } else if (star) {
+            p = star;
+            s = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p != pe && *p == QLatin1Char('*'))
+        ++p;
+    return p == pe;
+}
+
+static bool isLiteral(const QString& part)
+{
+    if (part.isEmpty())
+        return false;
+    foreach (const QChar& c, part) {
+        if (c == QLatin1Char('*') || c == QLatin1Char('?') || c == QLatin1Char('!') || c == QLatin1Char('@'))
+            return false;
+    }
+    return true;
+}
+
+// Splits a prefix the way the server sends it: the nick ends at the first
+// '!', the host starts after the last '@' and the ident sits in between.
+static void splitPrefix(const QString& prefix, QString* nick, QString* ident, QString* host)
+{
+    const int ex = prefix.indexOf(QLatin1Char('!'));
+    const int at = prefix.lastIndexOf(QLatin1Char('@'));
+    if (ex != -1 && at > ex) {
+        *nick = prefix.left(ex);
+        *ident = prefix.mid(ex + 1, at - ex - 1);
+        *host = prefix.mid(at + 1);
+    } else {
+        *nick = prefix;
+    }
+}
+
+// Returns the address in network byte order: 4 bytes for IPv4 and 16 bytes
+// for IPv6.
+static QByteArray addressBytes(const QHostAddress& address)
+{
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        const quint32 ipv4 = address.toIPv4Address();
+        QByteArray bytes(4, Qt::Uninitialized);
+        for (int i = 0; i < 4; ++i)
+            bytes[i] = char(ipv4 >> (24 - 8 * i));
+        return bytes;
+    }
+    if (address.protocol() == QAbstractSocket::IPv6Protocol) {
+        const Q_IPV6ADDR ipv6 = address.toIPv6Address();
+        return QByteArray(reinterpret_cast<const char*>(ipv6.c), 16);
+    }
+    return QByteArray();
+}
+
+// Hosts that cannot be numeric are rejected before parsing.
+static QByteArray addressBytes(const QString& host)
+{
+    if (host.isEmpty() || (!host.at(0).isDigit() && !host.contains(QLatin1Char(':'))))
+        return QByteArray();
+
+    QHostAddress address;
+    if (!address.setAddress(host))
+        return QByteArray();
+    return addressBytes(address);
+}
+
+static bool parseSubnet(const QString& host, QByteArray* address, int* length)
+{
+    if (!host.contains(QLatin1Char('/')))
+        return false;
+
+    const QPair<QHostAddress, int> subnet = QHostAddress::parseSubnet(host);
+    if (subnet.first.isNull() || subnet.second < 0)
+        return false;
+
+    *address = addressBytes(subnet.first);
+    *length = subnet.second;
+    return !address->isEmpty();
+}
+
+static inline int addressBit(const QByteArray& address, int index)
+{
+    return (uchar(address.at(index / 8)) >> (7 - index % 8)) & 1;
+}
+
+// A compiled mask in a snapshot: the record is followed by the mask, the
+// folded pattern and the index key, each padded to four bytes. Strings are
+// stored as raw UTF-16, so loading a record does not parse anything.
+struct SnapshotRecord {
+    quint8 kind;
+    quint8 length;
+    quint16 reserved;
+    quint32 maskSize;
+    quint32 patternSize;
+    quint32 keySize;
+};
+
+static inline int padded(int size)
+{
+    return (size + 3) & ~3;
+}
+
+static void appendPadded(QByteArray* data, const void* bytes, int size)
+{
+    data->append(static_cast<const char*>(bytes), size);
+    data->append(padded(size) - size, '\0');
+}
+
+IgnoreIndex::IgnoreIndex(CaseMapping::Type mapping)
+{
+    d.mapping = mapping;
+    d.count = 0;
+    d.wildcards = 0;
+    d.serial = 0;
+}
+
+CaseMapping::Type IgnoreIndex::caseMapping() const
+{
+    return d.mapping;
+}
+
+QString IgnoreIndex::folded(const QString& str) const
+{
+    return CaseMapping::fold(str, d.mapping);
+}
+
+int IgnoreIndex::count() const
+{
+    return d.count;
+}
+
+bool IgnoreIndex::isEmpty() const
+{
+    return !d.count;
+}
+
+bool IgnoreIndex::contains(const QString& mask) const
+{
+    const Shard* s = shard(shardOf(mask));
+    return s && s->patterns.contains(mask);
+}
+
+// Returns the masks in the order they were inserted.
+QStringList IgnoreIndex::masks() const
+{
+    QVector<QPair<qint64, QString> > ordered;
+    ordered.reserve(d.count);
+    foreach (const ShardPointer& s, d.shards) {
+        if (!s)
+            continue;
+        for (QHash<QString, Pattern>::const_iterator it = s->patterns.constBegin(); it != s->patterns.constEnd(); ++it)
+            ordered += qMakePair(it->serial, it.key());
+    }
+    std::sort(ordered.begin(), ordered.end());
+
+    QStringList masks;
+    masks.reserve(ordered.count());
+    for (int i = 0; i < ordered.count(); ++i)
+        masks += ordered.at(i).second;
+    return masks;
+}
+
+bool IgnoreIndex::insert(const QString& mask)
+{
+    if (contains(mask))
+        return false;
+
+    const QString pattern = folded(mask);
+    place(mask, pattern, classify(pattern));
+    return true;
+}
+
+bool IgnoreIndex::remove(const QString& mask)
+{
+    if (!contains(mask))
+        return false;
+
+    const QString pattern = shard(shardOf(mask)).patterns.take(mask).pattern;
+    --d.count;
+
+    const Key key = classify(pattern);
+    if (key.kind == WildcardKind)
+        --d.wildcards;
+    Bucket* bucket = findBucket(key, mask, false);
+    if (bucket && removeFromBucket(*bucket, mask) && key.kind != WildcardKind && key.kind != AddressKind)
+        literals(key).remove(key.literal);
+    return true;
+}
+
+void IgnoreIndex::clear()
+{
+    d.count = 0;
+    d.wildcards = 0;
+    d.shards.clear();
+    d.ipv4 = Tree();
+    d.ipv6 = Tree();
+}
+
+QString IgnoreIndex::match(const QString& prefix) const
+{
+    if (!d.count)
+        return QString();
+
+    const QString subject = folded(prefix);
+    QString nick, ident, host;
+    splitPrefix(subject, &nick, &ident, &host);
+
+    QString mask;
+    const Shard* s = shard(shardOf(nick));
+    if (s && !s->nicks.isEmpty() && matchBucket(s->nicks.value(nick), subject, &mask))
+        return mask;
+    s = host.isEmpty() ? 0 : shard(shardOf(host));
+    if (s && !s->hosts.isEmpty() && matchBucket(s->hosts.value(host), subject, &mask))
+        return mask;
+    s = ident.isEmpty() ? 0 : shard(shardOf(ident));
+    if (s && !s->idents.isEmpty() && matchBucket(s->idents.value(ident), subject, &mask))
+        return mask;
+    if ((d.ipv4 || d.ipv6) && !host.isEmpty()) {
+        const QByteArray address = addressBytes(host);
+        if (!address.isEmpty()) {
+            const Tree& tree = address.size() == 4 ? d.ipv4 : d.ipv6;
+            if (matchTree(tree, address, subject.left(subject.lastIndexOf(QLatin1Char('@'))), &mask))
+                return mask;
+        }
+    }
+    if (d.wildcards) {
+        foreach (const ShardPointer& p, d.shards) {
+            if (p && matchBucket(p->wildcards, subject, &mask))
+                return mask;
+        }
+    }
+    return QString();
+}
+
+// Matches a single mask the way the index would, without building one.
+bool IgnoreIndex::matches(const QString& mask, const QString& prefix, CaseMapping::Type mapping)
+{
+    const QString pattern = CaseMapping::fold(mask, mapping);
+    const QString subject = CaseMapping::fold(prefix, mapping);
+    const Key key = classify(pattern);
+    if (key.kind != AddressKind)
+        return wildcardMatch(pattern, subject);
+
+    QString nick, ident, host;
+    splitPrefix(subject, &nick, &ident, &host);
+    const QByteArray address = addressBytes(host);
+    if (address.size() != key.address.size())
+        return false;
+    for (int i = 0; i < key.length; ++i) {
+        if (addressBit(address, i) != addressBit(key.address, i))
+            return false;
+    }
+    return wildcardMatch(pattern.left(pattern.lastIndexOf(QLatin1Char('@'))), subject.left(subject.lastIndexOf(QLatin1Char('@'))));
+}
+
+// Appends the compiled record of a mask to a snapshot.
+bool IgnoreIndex::save(const QString& mask, QByteArray* data) const
+{
+    const Shard* s = shard(shardOf(mask));
+    const QString pattern = s ? s->patterns.value(mask).pattern : QString();
+    if (pattern.isNull())
+        return false;
+
+    const Key key = classify(pattern);
+    SnapshotRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = key.kind;
+    record.length = key.length;
+    record.maskSize = mask.size() * sizeof(QChar);
+    record.patternSize = pattern.size() * sizeof(QChar);
+    record.keySize = key.kind == AddressKind ? key.address.size() : key.literal.size() * sizeof(QChar);
+
+    data->append(reinterpret_cast<const char*>(&record), sizeof(record));
+    appendPadded(data, mask.constData(), record.maskSize);
+    appendPadded(data, pattern.constData(), record.patternSize);
+    if (key.kind == AddressKind)
+        appendPadded(data, key.address.constData(), record.keySize);
+    else
+        appendPadded(data, key.literal.constData(), record.keySize);
+    return true;
+}
+
+// Inserts one compiled record from a snapshot. Returns the number of bytes
+// consumed, or -1 if the record is malformed.
+int IgnoreIndex::load(const char* data, int size, QString* mask)
+{
+    SnapshotRecord record;
+    if (size < int(sizeof(record)))
+        return -1;
+    memcpy(&record, data, sizeof(record));
+
+    if (record.kind > AddressKind || record.maskSize % 2 || record.patternSize % 2)
+        return -1;
+    if (record.kind == AddressKind && ((record.keySize != 4 && record.keySize != 16) || record.length > record.keySize * 8))
+        return -1;
+    if (record.kind != AddressKind && record.keySize % 2)
+        return -1;
+
+    const qint64 total = sizeof(record) + qint64(padded(record.maskSize)) + padded(record.patternSize) + padded(record.keySize);
+    if (total > size)
+        return -1;
+
+    const char* ptr = data + sizeof(record);
+    const QString m(reinterpret_cast<const QChar*>(ptr), record.maskSize / sizeof(QChar));
+    ptr += padded(record.maskSize);
+    const QString pattern(reinterpret_cast<const QChar*>(ptr), record.patternSize / sizeof(QChar));
+    ptr += padded(record.patternSize);
+    if (m.isEmpty() || contains(m))
+        return -1;
+
+    Key key;
+    key.kind = Kind(record.kind);
+    key.length = record.length;
+    if (key.kind == AddressKind)
+        key.address = QByteArray(ptr, record.keySize);
+    else if (key.kind != WildcardKind)
+        key.literal = QString(reinterpret_cast<const QChar*>(ptr), record.keySize / sizeof(QChar));
+
+    place(m, pattern, key);
+    *mask = m;
+    return int(total);
+}
+
+bool IgnoreIndex::matchBucket(const Bucket& bucket, const QString& prefix, QString* mask)
+{
+    foreach (const Entry& entry, bucket) {
+        if (wildcardMatch(entry.pattern, prefix)) {
+            *mask = entry.mask;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool IgnoreIndex::removeFromBucket(Bucket& bucket, const QString& mask)
+{
+    for (int i = 0; i < bucket.count(); ++i) {
+        if (bucket.at(i).mask == mask) {
+            bucket.remove(i);
+            break;
+        }
+    }
+    return bucket.isEmpty();
+}
+
+// Masks are indexed by their most selective literal part, so that only
+// masks which are wildcards in every part need to be scanned linearly.
+// CIDR masks go to the radix tree of their address family instead.
+IgnoreIndex::Key IgnoreIndex::classify(const QString& pattern)
+{
+    Key key;
+    key.length = 0;
+
+    QString nick, ident, host;
+    splitPrefix(pattern, &nick, &ident, &host);
+    if (parseSubnet(host, &key.address, &key.length)) {
+        key.kind = AddressKind;
+    } else if (isLiteral(nick)) {
+        key.kind = NickKind;
+        key.literal = nick;
+    } else if (isLiteral(host)) {
+        key.kind = HostKind;
+        key.literal = host;
+    } else if (isLiteral(ident)) {
+        key.kind = IdentKind;
+        key.literal = ident;
+    } else {
+        key.kind = WildcardKind;
+    }
+    return key;
+}
+
+int IgnoreIndex::shardOf(const QString& key)
+{
+    return qHash(key) % ShardCount;
+}
+
+// Returns the shard, or null if nothing went into it yet.
+const IgnoreIndex::Shard* IgnoreIndex::shard(int index) const
+{
+    return d.shards.isEmpty() ? 0 : d.shards.at(index).constData();
+}
+
+// Returns a shard that is not shared with any copy of the index.
+IgnoreIndex::Shard& IgnoreIndex::shard(int index)
+{
+    if (d.shards.isEmpty())
+        d.shards.resize(ShardCount);
+    ShardPointer& s = d.shards[index];
+    if (!s)
+        s = new Shard;
+    return *s;
+}
+
+void IgnoreIndex::place(const QString& mask, const QString& pattern, const Key& key)
+{
+    Pattern p;
+    p.pattern = pattern;
+    p.serial = d.serial++;
+    shard(shardOf(mask)).patterns.insert(mask, p);
+    ++d.count;
+    if (key.kind == WildcardKind)
+        ++d.wildcards;
+
+    Entry entry;
+    entry.mask = mask;
+    entry.pattern = pattern;
+    // CIDR masks only keep the nick!ident part for glob matching
+    if (key.kind == AddressKind)
+        entry.pattern.truncate(pattern.lastIndexOf(QLatin1Char('@')));
+    findBucket(key, mask, true)->append(entry);
+}
+
+IgnoreIndex::Bucket* IgnoreIndex::findBucket(const Key& key, const QString& mask, bool create)
+{
+    if (key.kind == AddressKind)
+        return findBucket(key.address.size() == 4 ? d.ipv4 : d.ipv6, key.address, key.length, create);
+    if (key.kind == WildcardKind)
+        return &shard(shardOf(mask)).wildcards;
+
+    QHash<QString, Bucket>& hash = literals(key);
+    if (create)
+        return &hash[key.literal];
+    QHash<QString, Bucket>::iterator it = hash.find(key.literal);
+    return it != hash.end() ? &it.value() : 0;
+}
+
+QHash<QString, IgnoreIndex::Bucket>& IgnoreIndex::literals(const Key& key)
+{
+    Shard& s = shard(shardOf(key.literal));
+    return key.kind == NickKind ? s.nicks : key.kind == HostKind ? s.hosts : s.idents;
+}
+
+// Walking down through the non-const pointers detaches every node on the
+// path, so copies of the index keep the nodes they share untouched.
+IgnoreIndex::Bucket* IgnoreIndex::findBucket(Tree& tree, const QByteArray& address, int length, bool create)
+{
+    if (!tree) {
+        if (!create)
+            return 0;
+        tree = new Node;
+    }
+
+    Node* node = tree.data();
+    for (int i = 0; i < length; ++i) {
+        Tree& child = node->child[addressBit(address, i)];
+        if (!child) {
+            if (!create)
+                return 0;
+            child = new Node;
+        }
+        node = child.data();
+    }
+    return &node->bucket;
+}
+
+bool IgnoreIndex::matchTree(const Tree& tree, const QByteArray& address, const QString& prefix, QString* mask)
+{
+    // walk down the address bits, checking every subnet on the way
+    const int length = address.size() * 8;
+    const Node* node = tree.constData();
+    for (int i = 0; node; ++i) {
+        if (!node->bucket.isEmpty() && matchBucket(node->bucket, prefix, mask))
+            return true;
+        if (i == length)
+            break;
+        node = node->child[addressBit(address, i)].constData();
+    }
+    return false;
+}
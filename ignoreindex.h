@@ -0,0 +1,132 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef IGNOREINDEX_H
+#define IGNOREINDEX_H
+
+#include <QHash>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+#include <QStringList>
+#include <QSharedData>
+#include "casemapping.h"
+#include "sharedglobal.h"
+
+class SHARED_EXPORT IgnoreIndex
+{
+public:
+    explicit IgnoreIndex(CaseMapping::Type mapping = CaseMapping::Rfc1459);
+
+    CaseMapping::Type caseMapping() const;
+
+    QString folded(const QString& str) const;
+
+    int count() const;
+    bool isEmpty() const;
+    bool contains(const QString& mask) const;
+    QStringList masks() const;
+
+    bool insert(const QString& mask);
+    bool remove(const QString& mask);
+    void clear();
+
+    QString match(const QString& prefix) const;
+
+    static bool matches(const QString& mask, const QString& prefix, CaseMapping::Type mapping = CaseMapping::Rfc1459);
+
+    bool save(const QString& mask, QByteArray* data) const;
+    int load(const char* data, int size, QString* mask);
+
+private:
+    struct Entry {
+        QString mask;
+        QString pattern;
+    };
+    typedef QVector<Entry> Bucket;
+
+    enum Kind { NickKind, HostKind, IdentKind, WildcardKind, AddressKind };
+    struct Key {
+        Kind kind;
+        QString literal;
+        QByteArray address;
+        int length;
+    };
+
+    // binary radix tree over address bits, one node per prefix bit. Copies
+    // of the tree share their nodes and a change copies only its path.
+    struct Node : public QSharedData {
+        QSharedDataPointer<Node> child[2];
+        Bucket bucket;
+    };
+    typedef QSharedDataPointer<Node> Tree;
+
+    // Copies of an index share their shards, so that a change copies the
+    // shards it touches instead of every mask. Masks are sharded by their
+    // hash, the literal buckets by their key.
+    enum { ShardCount = 256 };
+    struct Pattern {
+        QString pattern;
+        qint64 serial;
+    };
+    struct Shard : public QSharedData {
+        QHash<QString, Pattern> patterns;
+        QHash<QString, Bucket> nicks;
+        QHash<QString, Bucket> idents;
+        QHash<QString, Bucket> hosts;
+        Bucket wildcards;
+    };
+    typedef QSharedDataPointer<Shard> ShardPointer;
+
+    static int shardOf(const QString& key);
+    const Shard* shard(int index) const;
+    Shard& shard(int index);
+
+    static bool matchBucket(const Bucket& bucket, const QString& prefix, QString* mask);
+    static bool removeFromBucket(Bucket& bucket, const QString& mask);
+
+    static Key classify(const QString& pattern);
+    void place(const QString& mask, const QString& pattern, const Key& key);
+    Bucket* findBucket(const Key& key, const QString& mask, bool create);
+    QHash<QString, Bucket>& literals(const Key& key);
+
+    static Bucket* findBucket(Tree& tree, const QByteArray& address, int length, bool create);
+    static bool matchTree(const Tree& tree, const QByteArray& address, const QString& prefix, QString* mask);
+
+    struct Private {
+        CaseMapping::Type mapping;
+        int count;
+        int wildcards;
+        qint64 serial;
+        QVector<ShardPointer> shards;
+        Tree ipv4;
+        Tree ipv6;
+    } d;
+};
+
+#endif // IGNOREINDEX_H
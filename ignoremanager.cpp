@@ -27,13 +27,70 @@
 */
 
 #include "ignoremanager.h"
+#include "sharedtimer.h"
+#include "filterpipeline.h"
+#include "latencyrecorder.h"
+#include <QSaveFile>
+#include <QFile>
+#include <QThread>
+#include <QSet>
 #include <ircconnection.h>
 #include <ircmessage.h>
-#include <qregexp.h>
 #include <irc.h>
+#include <string.h>
 
 IRC_USE_NAMESPACE
 
+static QString masked(const QString& ignore)
+{
+    QString nick = Irc::nickFromPrefix(ignore);
+    QString ident = Irc::identFromPrefix(ignore);
+    QString host = Irc::hostFromPrefix(ignore);
+    if (nick.isEmpty())
+        nick = ignore;
+    if (ident.isEmpty())
+        ident = "*";
+    if (host.isEmpty())
+        host = "*";
+    return nick + "!" + ident + "@" + host;
+}
+
+// The list setIgnores() would keep: masked and without duplicates.
+static QStringList normalized(const QStringList& ignores)
+{
+    QStringList masks;
+    QSet<QString> seen;
+    masks.reserve(ignores.count());
+    foreach (const QString& ignore, ignores) {
+        const QString mask = masked(ignore);
+        if (!seen.contains(mask)) {
+            seen.insert(mask);
+            masks += mask;
+        }
+    }
+    return masks;
+}
+
+// Pins the current snapshot for the lifetime of the reader. The readers
+// count only covers loading the pointer and taking the reference, which
+// is what a writer has to wait out before deleting a retired snapshot.
+struct IgnoreManager::Reader
+{
+    explicit Reader(const IgnoreManager* manager)
+    {
+        manager->d.readers.ref();
+        snapshot = manager->d.snapshot.loadAcquire();
+        snapshot->refs.ref();
+        manager->d.readers.deref();
+    }
+    ~Reader()
+    {
+        snapshot->refs.deref();
+    }
+    const Snapshot* operator->() const { return snapshot; }
+    const Snapshot* snapshot;
+};
+
 IgnoreManager* IgnoreManager::instance()
 {
     static IgnoreManager manager;
@@ -42,71 +99,621 @@ IgnoreManager* IgnoreManager::instance()
 
 IgnoreManager::IgnoreManager(QObject* parent) : QObject(parent)
 {
+    Snapshot* snapshot = new Snapshot;
+    snapshot->indexes.insert(CaseMapping::Rfc1459, IgnoreIndex(CaseMapping::Rfc1459));
+    d.snapshot.storeRelease(snapshot);
+    d.pending = 0;
+    d.updates = 0;
+    d.cache.setMaxCost(1024);
+    d.cacheHits = 0;
+    d.cacheMisses = 0;
+    d.tick = 0;
+    d.wheel.resize(WheelSize);
+    d.clock.start();
 }
 
 IgnoreManager::~IgnoreManager()
 {
+    qDeleteAll(d.retired);
+    delete d.pending;
+    delete d.snapshot.loadAcquire();
 }
 
+// Safe to call from the threads of any connection. Changing the ignores
+// and the content rules belongs to the thread of the manager.
 bool IgnoreManager::messageFilter(IrcMessage* message)
 {
+    const LatencyTimer timer(LatencyRecorder::IgnoreStage, message->type());
     if (message->type() == IrcMessage::Private || message->type() == IrcMessage::Notice) {
-        foreach (const QString& ignore, d.ignores) {
-            QRegExp rx(ignore, Qt::CaseInsensitive, QRegExp::Wildcard);
-            if (rx.exactMatch(message->prefix()))
-                return true;
+        const Reader snapshot(this);
+        const QString mask = match(snapshot.snapshot, message);
+        if (!mask.isNull()) {
+            countHit(mask);
+            return true;
         }
+        return matchContent(snapshot.snapshot, message);
     }
-    return false;
+
+    CaseMapping::Type mapping;
+    if (CaseMapping::fromMessage(message, &mapping))
+        setCaseMapping(message->connection(), mapping);
+    const Reader snapshot(this);
+    return matchContent(snapshot.snapshot, message);
+}
+
+// Returns the messages of the batch that are not ignored, in order.
+// Playback tends to repeat the same sender, so the verdict is carried
+// over while the prefix does not change.
+QList<IrcMessage*> IgnoreManager::filterBatch(IrcBatchMessage* batch)
+{
+    return filterMessages(batch->messages());
+}
+
+QList<IrcMessage*> IgnoreManager::filterMessages(const QList<IrcMessage*>& messages)
+{
+    const Reader snapshot(this);
+    QList<IrcMessage*> accepted;
+    accepted.reserve(messages.count());
+
+    QString prefix;
+    QString mask;
+    foreach (IrcMessage* message, messages) {
+        if (message->type() == IrcMessage::Private || message->type() == IrcMessage::Notice) {
+            if (prefix.isNull() || message->prefix() != prefix) {
+                prefix = message->prefix();
+                mask = match(snapshot.snapshot, message);
+            }
+            if (!mask.isNull()) {
+                countHit(mask);
+                continue;
+            }
+        }
+        if (!matchContent(snapshot.snapshot, message))
+            accepted += message;
+    }
+    return accepted;
 }
 
 QStringList IgnoreManager::ignores() const
 {
-    return d.ignores;
+    const Reader snapshot(this);
+    return snapshot->indexes.constFind(CaseMapping::Rfc1459)->masks();
 }
 
-static QString masked(const QString& ignore)
+QStringList IgnoreManager::contentRules() const
 {
-    QString nick = Irc::nickFromPrefix(ignore);
-    QString ident = Irc::identFromPrefix(ignore);
-    QString host = Irc::hostFromPrefix(ignore);
-    if (nick.isEmpty())
-        nick = ignore;
-    if (ident.isEmpty())
-        ident = "*";
-    if (host.isEmpty())
-        host = "*";
-    return nick + "!" + ident + "@" + host;
+    const Reader snapshot(this);
+    return snapshot->content.patterns();
+}
+
+uint IgnoreManager::contentRuleTypes(const QString& rule) const
+{
+    const Reader snapshot(this);
+    return snapshot->content.types(rule);
 }
 
-QString IgnoreManager::addIgnore(const QString& ignore)
+int IgnoreManager::cacheSize() const
+{
+    return d.cache.maxCost();
+}
+
+void IgnoreManager::setCacheSize(int size)
+{
+    d.cache.setMaxCost(qMax(0, size));
+}
+
+qint64 IgnoreManager::cacheHits() const
+{
+    return d.cacheHits;
+}
+
+qint64 IgnoreManager::cacheMisses() const
+{
+    return d.cacheMisses;
+}
+
+void IgnoreManager::resetCacheStatistics()
+{
+    d.cacheHits = 0;
+    d.cacheMisses = 0;
+}
+
+int IgnoreManager::hitCount(const QString& ignore) const
+{
+    QMutexLocker locker(&d.statistics);
+    return d.hits.value(masked(ignore));
+}
+
+void IgnoreManager::resetHitCounts()
+{
+    QMutexLocker locker(&d.statistics);
+    d.hits.clear();
+}
+
+void IgnoreManager::countHit(const QString& mask)
+{
+    QMutexLocker locker(&d.statistics);
+    ++d.hits[mask];
+}
+
+// Returns the seconds left until the ignore expires, or -1 if it is permanent.
+int IgnoreManager::remainingTime(const QString& ignore) const
+{
+    const qint64 deadline = d.deadlines.value(masked(ignore), -1);
+    if (deadline == -1)
+        return -1;
+    return qMax<qint64>(0, deadline - d.clock.elapsed() / 1000);
+}
+
+// A positive amount of seconds makes the ignore expire after that time.
+// Re-adding an existing mask replaces its expiry.
+QString IgnoreManager::addIgnore(const QString& ignore, int seconds)
 {
     const QString mask = masked(ignore);
-    if (!d.ignores.contains(mask))
-        d.ignores.append(mask);
+    QMutexLocker locker(&d.writer);
+    if (!current()->indexes.begin()->contains(mask)) {
+        Snapshot* snapshot = detach();
+        for (QHash<int, IgnoreIndex>::iterator it = snapshot->indexes.begin(); it != snapshot->indexes.end(); ++it)
+            it->insert(mask);
+        publish(snapshot);
+        if (!d.updates)
+            invalidateCache(mask);
+    }
+    scheduleExpiry(mask, seconds);
     return mask;
 }
 
 QString IgnoreManager::removeIgnore(const QString& ignore)
 {
     const QString mask = masked(ignore);
-    d.ignores.removeAll(mask);
+    QMutexLocker locker(&d.writer);
+    if (current()->indexes.begin()->contains(mask)) {
+        Snapshot* snapshot = detach();
+        for (QHash<int, IgnoreIndex>::iterator it = snapshot->indexes.begin(); it != snapshot->indexes.end(); ++it)
+            it->remove(mask);
+        publish(snapshot);
+        if (!d.updates)
+            invalidateCache(mask);
+        QMutexLocker statistics(&d.statistics);
+        d.hits.remove(mask);
+        d.deadlines.remove(mask);
+    }
     return mask;
 }
 
 void IgnoreManager::setIgnores(const QStringList& ignores)
 {
-    d.ignores.clear();
+    QMutexLocker locker(&d.writer);
+    Snapshot* snapshot = detach();
+
+    // the indexes are rebuilt from scratch instead of copying the old ones
+    QList<int> mappings = snapshot->indexes.keys();
+    mappings.removeOne(CaseMapping::Rfc1459);
+    snapshot->indexes.clear();
+    IgnoreIndex& first = index(snapshot, CaseMapping::Rfc1459);
     foreach (const QString& ignore, ignores)
-        d.ignores.append(masked(ignore));
+        first.insert(masked(ignore));
+    foreach (int mapping, mappings)
+        index(snapshot, mapping);
+    publish(snapshot);
+
+    d.cache.clear();
+    pruneStatistics();
+}
+
+// Keeps the statistics and expiries of the masks that remain.
+void IgnoreManager::pruneStatistics()
+{
+    const IgnoreIndex& index = *current()->indexes.constFind(CaseMapping::Rfc1459);
+    QMutexLocker locker(&d.statistics);
+    for (QHash<QString, int>::iterator it = d.hits.begin(); it != d.hits.end(); ) {
+        if (index.contains(it.key()))
+            ++it;
+        else
+            it = d.hits.erase(it);
+    }
+    for (QHash<QString, qint64>::iterator it = d.deadlines.begin(); it != d.deadlines.end(); ) {
+        if (index.contains(it.key()))
+            ++it;
+        else
+            it = d.deadlines.erase(it);
+    }
+    if (d.deadlines.isEmpty())
+        SharedTimer::instance()->unregisterReceiver(this, "expireIgnores");
+}
+
+// Content rules are plain substrings, matched case-insensitively against
+// the text of the message types selected by the bitmask. All rules are
+// compiled into one automaton.
+void IgnoreManager::addContentRule(const QString& rule, uint types)
+{
+    QMutexLocker locker(&d.writer);
+    Snapshot* snapshot = detach();
+    snapshot->content.insert(rule, types);
+    publish(snapshot);
+}
+
+void IgnoreManager::removeContentRule(const QString& rule)
+{
+    QMutexLocker locker(&d.writer);
+    Snapshot* snapshot = detach();
+    snapshot->content.remove(rule);
+    publish(snapshot);
+}
+
+void IgnoreManager::clearContentRules()
+{
+    QMutexLocker locker(&d.writer);
+    Snapshot* snapshot = detach();
+    snapshot->content.clear();
+    publish(snapshot);
+}
+
+// Masks are folded differently for each casemapping, so every casemapping
+// in use gets an index of its own. It is built when a connection first
+// reports the casemapping.
+IgnoreIndex& IgnoreManager::index(Snapshot* snapshot, int mapping)
+{
+    QHash<int, IgnoreIndex>::iterator it = snapshot->indexes.find(mapping);
+    if (it == snapshot->indexes.end()) {
+        const QStringList masks = snapshot->indexes.value(CaseMapping::Rfc1459).masks();
+        it = snapshot->indexes.insert(mapping, IgnoreIndex(CaseMapping::Type(mapping)));
+        foreach (const QString& mask, masks)
+            it->insert(mask);
+    }
+    return *it;
+}
+
+// The cache maps a prefix to the mask it matched, or to a
+// null string when no mask matched, in least recently used order.
+// It belongs to the thread of the manager; other threads go straight
+// to the index.
+QString IgnoreManager::match(const Snapshot* snapshot, IrcMessage* message)
+{
+    const int mapping = snapshot->mappings.value(message->connection(), CaseMapping::Rfc1459);
+    QHash<int, IgnoreIndex>::const_iterator index = snapshot->indexes.constFind(mapping);
+    if (index == snapshot->indexes.constEnd())
+        index = snapshot->indexes.constFind(CaseMapping::Rfc1459);
+
+    if (QThread::currentThread() != thread())
+        return index->match(message->prefix());
+
+    const CacheKey key(index.key(), message->prefix());
+    if (const QString* mask = d.cache.object(key)) {
+        ++d.cacheHits;
+        return *mask;
+    }
+    ++d.cacheMisses;
+    const QString mask = index->match(key.second);
+    d.cache.insert(key, new QString(mask));
+    return mask;
+}
+
+static QString messageText(IrcMessage* message)
+{
+    switch (message->type()) {
+        case IrcMessage::Private: return static_cast<IrcPrivateMessage*>(message)->content();
+        case IrcMessage::Notice: return static_cast<IrcNoticeMessage*>(message)->content();
+        case IrcMessage::Part: return static_cast<IrcPartMessage*>(message)->reason();
+        case IrcMessage::Quit: return static_cast<IrcQuitMessage*>(message)->reason();
+        case IrcMessage::Kick: return static_cast<IrcKickMessage*>(message)->reason();
+        case IrcMessage::Topic: return static_cast<IrcTopicMessage*>(message)->topic();
+        case IrcMessage::Nick: return static_cast<IrcNickMessage*>(message)->newNick();
+        case IrcMessage::Join: return message->nick();
+        default: return QString();
+    }
+}
+
+bool IgnoreManager::matchContent(const Snapshot* snapshot, IrcMessage* message)
+{
+    const uint type = 1u << message->type();
+    if (!(snapshot->content.types() & type))
+        return false;
+    return !snapshot->content.match(messageText(message), type).isNull();
+}
+
+// Changes made between beginUpdate() and commitUpdate() are published
+// together, so that loading many ignores or rules copies the snapshot
+// once instead of once per change. Updates can be nested.
+void IgnoreManager::beginUpdate()
+{
+    QMutexLocker locker(&d.writer);
+    ++d.updates;
+}
+
+void IgnoreManager::commitUpdate()
+{
+    QMutexLocker locker(&d.writer);
+    if (d.updates <= 0) {
+        qWarning("IgnoreManager::commitUpdate(): no update in progress");
+        return;
+    }
+    if (--d.updates == 0 && d.pending) {
+        Snapshot* snapshot = d.pending;
+        d.pending = 0;
+        publish(snapshot);
+        d.cache.clear();
+    }
+}
+
+// The snapshot that the next change applies to. Call with the writer
+// lock held.
+const IgnoreManager::Snapshot* IgnoreManager::current() const
+{
+    return d.pending ? d.pending : d.snapshot.loadAcquire();
+}
+
+// Returns a private copy of the current snapshot, or the pending copy
+// of an update in progress. Call with the writer lock held and hand the
+// copy to publish().
+IgnoreManager::Snapshot* IgnoreManager::detach()
+{
+    if (d.pending)
+        return d.pending;
+    Snapshot* snapshot = new Snapshot(*d.snapshot.loadAcquire());
+    snapshot->refs.storeRelease(0);
+    return snapshot;
+}
+
+void IgnoreManager::publish(Snapshot* snapshot)
+{
+    if (d.updates) {
+        d.pending = snapshot;
+        return;
+    }
+    // readers on other threads must not build the automaton lazily
+    snapshot->content.build();
+    d.retired += d.snapshot.fetchAndStoreOrdered(snapshot);
+    if (!reclaim())
+        QMetaObject::invokeMethod(this, "reclaimLater", Qt::QueuedConnection);
+}
+
+// A retired snapshot can go once it is not referenced and no reader is
+// in the middle of picking up a snapshot, since those readers may still
+// be about to reference it. Returns false when some had to stay.
+bool IgnoreManager::reclaim()
+{
+    if (d.readers.loadAcquire() != 0)
+        return d.retired.isEmpty();
+
+    for (int i = d.retired.count() - 1; i >= 0; --i) {
+        if (d.retired.at(i)->refs.loadAcquire() == 0)
+            delete d.retired.takeAt(i);
+    }
+    return d.retired.isEmpty();
+}
+
+void IgnoreManager::reclaimLater()
+{
+    SharedTimer::instance()->registerReceiver(this, "reclaimSnapshots");
+}
+
+void IgnoreManager::reclaimSnapshots()
+{
+    QMutexLocker locker(&d.writer);
+    if (reclaim())
+        SharedTimer::instance()->unregisterReceiver(this, "reclaimSnapshots");
+}
+
+void IgnoreManager::invalidateCache(const QString& mask)
+{
+    // only the verdicts of prefixes matched by the mask can change
+    foreach (const CacheKey& key, d.cache.keys()) {
+        if (IgnoreIndex::matches(mask, key.second, CaseMapping::Type(key.first)))
+            d.cache.remove(key);
+    }
+}
+
+void IgnoreManager::setCaseMapping(IrcConnection* connection, CaseMapping::Type mapping)
+{
+    if (!connection)
+        return;
+
+    QMutexLocker locker(&d.writer);
+    const Snapshot* existing = current();
+    if (existing->mappings.value(connection, -1) == mapping)
+        return;
+
+    if (!existing->mappings.contains(connection))
+        connect(connection, &QObject::destroyed, this, &IgnoreManager::removeCaseMapping);
+    Snapshot* snapshot = detach();
+    snapshot->mappings.insert(connection, mapping);
+    index(snapshot, mapping);
+    publish(snapshot);
+}
+
+void IgnoreManager::removeCaseMapping(QObject* connection)
+{
+    QMutexLocker locker(&d.writer);
+    Snapshot* snapshot = detach();
+    snapshot->mappings.remove(connection);
+    publish(snapshot);
+}
+
+void IgnoreManager::scheduleExpiry(const QString& mask, int seconds)
+{
+    if (seconds <= 0) {
+        d.deadlines.remove(mask);
+        return;
+    }
+
+    // the tick counter may lag behind while the shared timer is paused
+    const qint64 deadline = qMax(d.tick, d.clock.elapsed() / 1000) + seconds;
+    d.deadlines.insert(mask, deadline);
+    Expiry expiry;
+    expiry.mask = mask;
+    expiry.deadline = deadline;
+    d.wheel[deadline % WheelSize].append(expiry);
+    SharedTimer::instance()->registerReceiver(this, "expireIgnores");
+}
+
+void IgnoreManager::expireIgnores()
+{
+    const qint64 now = d.clock.elapsed() / 1000;
+    if (now - d.tick > WheelSize)
+        d.tick = now - WheelSize;
+
+    QStringList expired;
+    while (d.tick < now) {
+        ++d.tick;
+        QVector<Expiry>& slot = d.wheel[d.tick % WheelSize];
+        for (int i = 0; i < slot.count(); ) {
+            const Expiry& expiry = slot.at(i);
+            if (expiry.deadline > now) {
+                ++i;
+                continue;
+            }
+            // entries of removed or rescheduled masks are dropped lazily
+            if (d.deadlines.value(expiry.mask, -1) == expiry.deadline)
+                expired += expiry.mask;
+            slot.remove(i);
+        }
+    }
+
+    beginUpdate();
+    foreach (const QString& mask, expired)
+        removeIgnore(mask);
+    commitUpdate();
+    foreach (const QString& mask, expired)
+        emit ignoreExpired(mask);
+
+    if (d.deadlines.isEmpty())
+        SharedTimer::instance()->unregisterReceiver(this, "expireIgnores");
+}
+
+struct SnapshotHeader {
+    char magic[4];
+    quint32 version;
+    quint64 source;
+    quint32 count;
+    quint32 size;
+    quint16 checksum;
+    quint16 mapping;
+    quint32 reserved;
+};
+
+static const char SnapshotMagic[4] = { 'C', 'I', 'G', 'N' };
+static const quint32 SnapshotVersion = 1;
+
+// FNV-1a over the ignore list, stable across runs unlike qHash()
+static quint64 sourceHash(const QStringList& ignores)
+{
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    foreach (const QString& ignore, ignores) {
+        const ushort* data = ignore.utf16();
+        for (int i = 0; i <= ignore.size(); ++i) {
+            hash ^= data[i];
+            hash *= Q_UINT64_C(1099511628211);
+        }
+    }
+    return hash;
+}
+
+// Writes the compiled rfc1459 index in ignores() order. The file is
+// replaced atomically, so a crash never leaves a half written snapshot.
+bool IgnoreManager::saveSnapshot(const QString& fileName) const
+{
+    const Reader snapshot(this);
+    const IgnoreIndex& index = *snapshot->indexes.constFind(CaseMapping::Rfc1459);
+
+    const QStringList masks = index.masks();
+    QByteArray payload;
+    foreach (const QString& mask, masks)
+        index.save(mask, &payload);
+
+    SnapshotHeader header;
+    memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+    header.version = SnapshotVersion;
+    header.source = sourceHash(masks);
+    header.count = masks.count();
+    header.size = payload.size();
+    header.checksum = qChecksum(payload.constData(), payload.size());
+    header.mapping = CaseMapping::Rfc1459;
+    header.reserved = 0;
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(payload);
+    return file.commit();
+}
+
+// Restores the index from a snapshot written by saveSnapshot(). The file
+// is memory mapped and its records are inserted without parsing the masks.
+// Falls back to setIgnores() and returns false when the snapshot does not
+// belong to the given ignore list or is damaged.
+bool IgnoreManager::loadSnapshot(const QString& fileName, const QStringList& ignores)
+{
+    QFile file(fileName);
+    if (file.open(QIODevice::ReadOnly)) {
+        if (const uchar* data = file.map(0, file.size())) {
+            if (loadSnapshot(reinterpret_cast<const char*>(data), file.size(), ignores))
+                return true;
+        } else if (loadSnapshot(file.readAll().constData(), file.size(), ignores)) {
+            return true;
+        }
+    }
+    setIgnores(ignores);
+    return false;
+}
+
+bool IgnoreManager::loadSnapshot(const char* data, qint64 size, const QStringList& ignores)
+{
+    SnapshotHeader header;
+    if (size < qint64(sizeof(header)))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) || header.version != SnapshotVersion)
+        return false;
+    if (header.mapping != CaseMapping::Rfc1459 || header.size != size - qint64(sizeof(header)))
+        return false;
+    // the snapshot was hashed over the masks, not over what the caller passes
+    const QStringList sources = normalized(ignores);
+    if (header.count != uint(sources.count()) || header.source != sourceHash(sources))
+        return false;
+
+    const char* payload = data + sizeof(header);
+    if (header.checksum != qChecksum(payload, header.size))
+        return false;
+
+    IgnoreIndex index(CaseMapping::Rfc1459);
+    QStringList masks;
+    masks.reserve(header.count);
+    qint64 offset = 0;
+    while (offset < header.size) {
+        QString mask;
+        const int consumed = index.load(payload + offset, header.size - offset, &mask);
+        if (consumed <= 0)
+            return false;
+        masks += mask;
+        offset += consumed;
+    }
+    if (masks.count() != sources.count())
+        return false;
+
+    QMutexLocker locker(&d.writer);
+    Snapshot* snapshot = detach();
+    QList<int> mappings = snapshot->indexes.keys();
+    mappings.removeOne(CaseMapping::Rfc1459);
+    snapshot->indexes.clear();
+    snapshot->indexes.insert(CaseMapping::Rfc1459, index);
+    foreach (int mapping, mappings)
+        IgnoreManager::index(snapshot, mapping);
+    publish(snapshot);
+
+    d.cache.clear();
+    pruneStatistics();
+    return true;
 }
 
 void IgnoreManager::addConnection(IrcConnection* connection)
 {
-    connection->installMessageFilter(this);
+    FilterPipeline::forConnection(connection)->addStage("ignore", this);
 }
 
 void IgnoreManager::removeConnection(IrcConnection* connection)
 {
-    connection->removeMessageFilter(this);
+    FilterPipeline::forConnection(connection)->removeStage(this);
 }
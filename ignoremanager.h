@@ -30,11 +30,23 @@
 #define IGNOREMANAGER_H
 
 #include <QObject>
+#include <QHash>
+#include <QPair>
+#include <QCache>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QMutex>
 #include <QStringList>
+#include <IrcMessage>
 #include <IrcMessageFilter>
+#include "contentmatcher.h"
+#include "ignoreindex.h"
 #include "sharedglobal.h"
 
 IRC_FORWARD_DECLARE_CLASS(IrcMessage)
+IRC_FORWARD_DECLARE_CLASS(IrcBatchMessage)
 IRC_FORWARD_DECLARE_CLASS(IrcConnection)
 
 class SHARED_EXPORT IgnoreManager : public QObject, public IrcMessageFilter
@@ -42,28 +54,125 @@ class SHARED_EXPORT IgnoreManager : public QObject, public IrcMessageFilter
     Q_OBJECT
     Q_INTERFACES(IrcMessageFilter)
     Q_PROPERTY(QStringList ignores READ ignores WRITE setIgnores)
+    Q_PROPERTY(int cacheSize READ cacheSize WRITE setCacheSize)
 
 public:
+    // content rule types are bitmasks of (1 << IrcMessage::Type)
+    enum { DefaultContentTypes = (1 << IrcMessage::Private) | (1 << IrcMessage::Notice) };
+
     static IgnoreManager* instance();
     virtual ~IgnoreManager();
 
     bool messageFilter(IrcMessage* message);
+    QList<IrcMessage*> filterBatch(IrcBatchMessage* batch);
+    QList<IrcMessage*> filterMessages(const QList<IrcMessage*>& messages);
 
     QStringList ignores() const;
 
+    int cacheSize() const;
+    void setCacheSize(int size);
+
+    qint64 cacheHits() const;
+    qint64 cacheMisses() const;
+    void resetCacheStatistics();
+
+    int hitCount(const QString& ignore) const;
+    void resetHitCounts();
+
+    int remainingTime(const QString& ignore) const;
+
+    QStringList contentRules() const;
+    uint contentRuleTypes(const QString& rule) const;
+
+    void beginUpdate();
+    void commitUpdate();
+
+    bool saveSnapshot(const QString& fileName) const;
+    bool loadSnapshot(const QString& fileName, const QStringList& ignores);
+
 public slots:
-    QString addIgnore(const QString& ignore);
+    QString addIgnore(const QString& ignore, int seconds = 0);
     QString removeIgnore(const QString& ignore);
     void setIgnores(const QStringList& ignores);
 
+    void addContentRule(const QString& rule, uint types = DefaultContentTypes);
+    void removeContentRule(const QString& rule);
+    void clearContentRules();
+
     void addConnection(IrcConnection* connection);
     void removeConnection(IrcConnection* connection);
 
+signals:
+    void ignoreExpired(const QString& mask);
+
 private:
     explicit IgnoreManager(QObject* parent = 0);
 
+    struct Snapshot;
+    struct Reader;
+
+    static IgnoreIndex& index(Snapshot* snapshot, int mapping);
+    QString match(const Snapshot* snapshot, IrcMessage* message);
+    static bool matchContent(const Snapshot* snapshot, IrcMessage* message);
+    const Snapshot* current() const;
+    Snapshot* detach();
+    void publish(Snapshot* snapshot);
+    bool reclaim();
+    void countHit(const QString& mask);
+    void invalidateCache(const QString& mask);
+    void setCaseMapping(IrcConnection* connection, CaseMapping::Type mapping);
+    void scheduleExpiry(const QString& mask, int seconds);
+    void pruneStatistics();
+    bool loadSnapshot(const char* data, qint64 size, const QStringList& ignores);
+
+private slots:
+    void removeCaseMapping(QObject* connection);
+    void expireIgnores();
+    void reclaimLater();
+    void reclaimSnapshots();
+
+private:
+    typedef QPair<int, QString> CacheKey;
+
+    // hashed timer wheel with one slot per second; a slot holds every
+    // expiry whose deadline falls on it modulo the wheel size
+    struct Expiry {
+        QString mask;
+        qint64 deadline;
+    };
+    enum { WheelSize = 256 };
+
+    // Everything a message filter reads is kept in an immutable snapshot,
+    // so connections on other threads can filter without taking a lock.
+    // Changes copy the snapshot, modify the copy and publish it in place
+    // of the old one, which is deleted once no reader holds it anymore.
+    // Between beginUpdate() and commitUpdate() the changes go to one
+    // pending copy that is published once. The copies share the shards
+    // of their indexes, so a single change copies little more than the
+    // shards it touches. The rfc1459 index keeps the order of ignores().
+    struct Snapshot {
+        ContentMatcher content;
+        QHash<int, IgnoreIndex> indexes;
+        QHash<QObject*, int> mappings;
+        mutable QAtomicInt refs;
+    };
+
     struct Private {
-        QStringList ignores;
+        QAtomicPointer<Snapshot> snapshot;
+        mutable QAtomicInt readers;
+        QVector<Snapshot*> retired;
+        Snapshot* pending;
+        int updates;
+        mutable QMutex writer;
+        QCache<CacheKey, QString> cache;
+        qint64 cacheHits;
+        qint64 cacheMisses;
+        mutable QMutex statistics;
+        QHash<QString, int> hits;
+        QHash<QString, qint64> deadlines;
+        QVector<QVector<Expiry> > wheel;
+        QElapsedTimer clock;
+        qint64 tick;
     } d;
 };
 
@@ -0,0 +1,250 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "latencyrecorder.h"
+#include "sharedtimer.h"
+#include <QMetaMethod>
+#include <QMetaEnum>
+#include <QtDebug>
+#include <ircmessage.h>
+#include <qmath.h>
+
+IRC_USE_NAMESPACE
+
+QBasicAtomicInt LatencyRecorder::enabled = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+static const char* const stageNames[] = { "ignore", "znc filter", "znc process", "handler" };
+
+LatencyRecorder::Snapshot::Snapshot() : buckets(BucketCount), count(0), total(0), max(0)
+{
+}
+
+qint64 LatencyRecorder::Snapshot::mean() const
+{
+    return count ? total / count : 0;
+}
+
+// Returns the upper bound of the bucket that holds the given percentile.
+qint64 LatencyRecorder::Snapshot::percentile(double percent) const
+{
+    if (!count)
+        return 0;
+
+    const quint64 target = qMax<quint64>(1, qCeil(count * qBound(0.0, percent, 100.0) / 100.0));
+    quint64 seen = 0;
+    for (int i = 0; i < buckets.count(); ++i) {
+        seen += buckets.at(i);
+        if (seen >= target)
+            return qMin<qint64>(bucketValue(i), max);
+    }
+    return max;
+}
+
+// Latencies are recorded per stage and message type in lock-free
+// histograms that are allocated on first use. Nothing is recorded
+// while the recorder is disabled, which is the default.
+LatencyRecorder* LatencyRecorder::instance()
+{
+    static LatencyRecorder recorder;
+    return &recorder;
+}
+
+LatencyRecorder::LatencyRecorder(QObject* parent) : QObject(parent)
+{
+    d.dumpInterval = 0;
+    d.dumped = 0;
+    d.clock.start();
+}
+
+LatencyRecorder::~LatencyRecorder()
+{
+    for (int s = 0; s < StageCount; ++s) {
+        for (int t = 0; t < TypeCount; ++t)
+            delete d.histograms[s][t].loadAcquire();
+    }
+}
+
+void LatencyRecorder::setEnabled(bool enabled)
+{
+    LatencyRecorder::enabled.storeRelease(enabled);
+}
+
+int LatencyRecorder::dumpInterval() const
+{
+    return d.dumpInterval;
+}
+
+// A positive interval in milliseconds dumps the histograms periodically,
+// through dumped() when it is connected and to the debug output otherwise.
+void LatencyRecorder::setDumpInterval(int interval)
+{
+    d.dumpInterval = qMax(0, interval);
+    d.dumped = d.clock.elapsed();
+    if (d.dumpInterval)
+        SharedTimer::instance()->registerReceiver(this, "dumpLater");
+    else
+        SharedTimer::instance()->unregisterReceiver(this, "dumpLater");
+}
+
+qint64 LatencyRecorder::now()
+{
+    return instance()->d.clock.nsecsElapsed();
+}
+
+void LatencyRecorder::record(Stage stage, int type, qint64 nsecs)
+{
+    Histogram* h = histogram(stage, type);
+    if (!h)
+        return;
+
+    const quint64 value = qMax<qint64>(0, nsecs);
+    h->buckets[bucket(value)].fetchAndAddRelaxed(1);
+    h->total.fetchAndAddRelaxed(value);
+    quint64 max = h->max.loadAcquire();
+    while (value > max && !h->max.testAndSetRelaxed(max, value))
+        max = h->max.loadAcquire();
+}
+
+LatencyRecorder::Snapshot LatencyRecorder::snapshot(Stage stage, int type) const
+{
+    Snapshot snapshot;
+    if (stage < 0 || stage >= StageCount)
+        return snapshot;
+
+    if (type == AllTypes) {
+        for (int t = 0; t < TypeCount; ++t)
+            add(&snapshot, d.histograms[stage][t].loadAcquire());
+    } else if (type >= 0 && type < TypeCount) {
+        add(&snapshot, d.histograms[stage][type].loadAcquire());
+    }
+    return snapshot;
+}
+
+QString LatencyRecorder::dump() const
+{
+    const QMetaEnum types = IrcMessage::staticMetaObject.enumerator(IrcMessage::staticMetaObject.indexOfEnumerator("Type"));
+
+    QString report;
+    for (int s = 0; s < StageCount; ++s) {
+        for (int t = AllTypes; t < TypeCount; ++t) {
+            const Snapshot snap = snapshot(Stage(s), t);
+            if (!snap.count)
+                continue;
+            const QString type = t == AllTypes ? QString("all") : QString(types.valueToKey(t));
+            report += QString("%1 %2: count %3 mean %4ns p50 %5ns p90 %6ns p99 %7ns max %8ns\n")
+                        .arg(stageNames[s]).arg(type.isEmpty() ? QString::number(t) : type)
+                        .arg(snap.count).arg(snap.mean())
+                        .arg(snap.percentile(50)).arg(snap.percentile(90)).arg(snap.percentile(99))
+                        .arg(snap.max);
+        }
+    }
+    return report;
+}
+
+void LatencyRecorder::reset()
+{
+    for (int s = 0; s < StageCount; ++s) {
+        for (int t = 0; t < TypeCount; ++t) {
+            Histogram* h = d.histograms[s][t].loadAcquire();
+            if (!h)
+                continue;
+            for (int i = 0; i < BucketCount; ++i)
+                h->buckets[i].storeRelease(0);
+            h->total.storeRelease(0);
+            h->max.storeRelease(0);
+        }
+    }
+}
+
+int LatencyRecorder::bucket(qint64 nsecs)
+{
+    const quint64 value = qBound<qint64>(0, nsecs, (Q_INT64_C(1) << 41) - 1);
+    if (value < SubBuckets)
+        return value;
+    int msb = 63;
+    while (!(value & (Q_UINT64_C(1) << msb)))
+        --msb;
+    const int sub = (value >> (msb - 3)) & (SubBuckets - 1);
+    return SubBuckets + (msb - 3) * SubBuckets + sub;
+}
+
+qint64 LatencyRecorder::bucketValue(int bucket)
+{
+    if (bucket < SubBuckets)
+        return bucket;
+    const int msb = (bucket - SubBuckets) / SubBuckets + 3;
+    const int sub = (bucket - SubBuckets) % SubBuckets;
+    const qint64 lower = qint64(SubBuckets + sub) << (msb - 3);
+    return lower + (Q_INT64_C(1) << (msb - 3)) - 1;
+}
+
+void LatencyRecorder::dumpLater()
+{
+    if (d.clock.elapsed() - d.dumped < d.dumpInterval)
+        return;
+    d.dumped = d.clock.elapsed();
+
+    const QString report = dump();
+    static const QMetaMethod signal = QMetaMethod::fromSignal(&LatencyRecorder::dumped);
+    if (isSignalConnected(signal))
+        emit dumped(report);
+    else if (!report.isEmpty())
+        qDebug().noquote() << report;
+}
+
+LatencyRecorder::Histogram* LatencyRecorder::histogram(Stage stage, int type)
+{
+    if (stage < 0 || stage >= StageCount || type < 0 || type >= TypeCount)
+        return 0;
+
+    QAtomicPointer<Histogram>& slot = d.histograms[stage][type];
+    Histogram* h = slot.loadAcquire();
+    if (!h) {
+        Histogram* created = new Histogram;
+        if (slot.testAndSetOrdered(0, created)) {
+            h = created;
+        } else {
+            delete created;
+            h = slot.loadAcquire();
+        }
+    }
+    return h;
+}
+
+void LatencyRecorder::add(Snapshot* snapshot, const Histogram* histogram) const
+{
+    if (!histogram)
+        return;
+    for (int i = 0; i < BucketCount; ++i) {
+        const quint64 count = histogram->buckets[i].loadAcquire();
+        snapshot->buckets[i] += count;
+        snapshot->count += count;
+    }
+    snapshot->total += histogram->total.loadAcquire();
+    snapshot->max = qMax<quint64>(snapshot->max, histogram->max.loadAcquire());
+}
@@ -0,0 +1,138 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LATENCYRECORDER_H
+#define LATENCYRECORDER_H
+
+#include <QObject>
+#include <QVector>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include "sharedglobal.h"
+
+class SHARED_EXPORT LatencyRecorder : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(bool enabled READ isEnabled WRITE setEnabled)
+    Q_PROPERTY(int dumpInterval READ dumpInterval WRITE setDumpInterval)
+
+public:
+    enum Stage {
+        IgnoreStage,
+        ZncFilterStage,
+        ZncProcessStage,
+        HandlerStage,
+        StageCount
+    };
+
+    enum { TypeCount = 32, AllTypes = -1 };
+
+    // log-linear buckets: exact below 8ns, then 8 buckets per power of two
+    // up to 2^40ns, which keeps the relative error of a value under 12.5%
+    enum { SubBuckets = 8, BucketCount = 8 + 38 * SubBuckets };
+
+    struct SHARED_EXPORT Snapshot {
+        Snapshot();
+        QVector<quint64> buckets;
+        quint64 count;
+        quint64 total;
+        quint64 max;
+
+        qint64 mean() const;
+        qint64 percentile(double percent) const;
+    };
+
+    static LatencyRecorder* instance();
+    virtual ~LatencyRecorder();
+
+    static bool isEnabled() { return enabled.loadAcquire(); }
+    void setEnabled(bool enabled);
+
+    int dumpInterval() const;
+    void setDumpInterval(int interval);
+
+    static qint64 now();
+    void record(Stage stage, int type, qint64 nsecs);
+
+    Snapshot snapshot(Stage stage, int type = AllTypes) const;
+    QString dump() const;
+    void reset();
+
+    static int bucket(qint64 nsecs);
+    static qint64 bucketValue(int bucket);
+
+signals:
+    void dumped(const QString& report);
+
+private slots:
+    void dumpLater();
+
+private:
+    explicit LatencyRecorder(QObject* parent = 0);
+
+    struct Histogram {
+        QAtomicInteger<quint64> buckets[BucketCount];
+        QAtomicInteger<quint64> total;
+        QAtomicInteger<quint64> max;
+    };
+
+    Histogram* histogram(Stage stage, int type);
+    void add(Snapshot* snapshot, const Histogram* histogram) const;
+
+    static QBasicAtomicInt enabled;
+
+    struct Private {
+        int dumpInterval;
+        QElapsedTimer clock;
+        qint64 dumped;
+        QAtomicPointer<Histogram> histograms[StageCount][TypeCount];
+    } d;
+};
+
+// Records the time until the end of the scope. Costs one atomic load
+// while the recorder is disabled.
+class LatencyTimer
+{
+public:
+    LatencyTimer(LatencyRecorder::Stage stage, int type)
+        : stage(stage), type(type), started(LatencyRecorder::isEnabled() ? LatencyRecorder::now() : -1) { }
+    ~LatencyTimer()
+    {
+        if (started != -1)
+            LatencyRecorder::instance()->record(stage, type, LatencyRecorder::now() - started);
+    }
+
+private:
+    LatencyRecorder::Stage stage;
+    int type;
+    qint64 started;
+};
+
+#endif // LATENCYRECORDER_H
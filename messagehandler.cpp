@@ -27,22 +27,191 @@
 */
 
 #include "messagehandler.h"
+#include "sharedtimer.h"
+#include "latencyrecorder.h"
+#include "filterpipeline.h"
 #include <IrcBufferModel>
 #include <IrcConnection>
 #include <IrcMessage>
 #include <IrcChannel>
 #include <IrcBuffer>
 #include <Irc>
+#include <QTimerEvent>
+#include <QMetaMethod>
 
 IRC_USE_NAMESPACE
 
+// Multi-line replies that are aggregated into one delivery. A start reply
+// opens a sequence, member replies join or open it, any-replies join
+// whatever sequence is open and the end reply closes it.
+enum Sequence { NoSequence, WhoisSequence, WhowasSequence, WhoSequence, ListSequence,
+                BanListSequence, ExceptListSequence, InviteListSequence, MotdSequence };
+enum ReplyRole { NoRole, StartRole, MemberRole, AnyRole, EndRole };
+
+static const struct {
+    int code;
+    int sequence;
+    int role;
+} replyTable[] = {
+    { Irc::RPL_WHOISUSER, WhoisSequence, StartRole },
+    { Irc::RPL_WHOISREGNICK, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISOPERATOR, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISIDLE, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISCHANNELS, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISACCOUNT, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISHOST, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISMODES, WhoisSequence, MemberRole },
+    { Irc::RPL_WHOISSECURE, WhoisSequence, MemberRole },
+    { Irc::RPL_ENDOFWHOIS, WhoisSequence, EndRole },
+    { Irc::RPL_WHOWASUSER, WhowasSequence, StartRole },
+    { Irc::RPL_ENDOFWHOWAS, WhowasSequence, EndRole },
+    { Irc::RPL_WHOISSERVER, NoSequence, AnyRole },
+    { Irc::RPL_AWAY, NoSequence, AnyRole },
+    { Irc::RPL_WHOREPLY, WhoSequence, MemberRole },
+    { Irc::RPL_WHOSPCRPL, WhoSequence, MemberRole },
+    { Irc::RPL_ENDOFWHO, WhoSequence, EndRole },
+    { Irc::RPL_LISTSTART, ListSequence, StartRole },
+    { Irc::RPL_LIST, ListSequence, MemberRole },
+    { Irc::RPL_LISTEND, ListSequence, EndRole },
+    { Irc::RPL_BANLIST, BanListSequence, MemberRole },
+    { Irc::RPL_ENDOFBANLIST, BanListSequence, EndRole },
+    { Irc::RPL_EXCEPTLIST, ExceptListSequence, MemberRole },
+    { Irc::RPL_ENDOFEXCEPTLIST, ExceptListSequence, EndRole },
+    { Irc::RPL_INVITELIST, InviteListSequence, MemberRole },
+    { Irc::RPL_ENDOFINVITELIST, InviteListSequence, EndRole },
+    { Irc::RPL_MOTDSTART, MotdSequence, StartRole },
+    { Irc::RPL_MOTD, MotdSequence, MemberRole },
+    { Irc::RPL_ENDOFMOTD, MotdSequence, EndRole }
+};
+
+// how long a nick that left in a netsplit is remembered for its netjoin
+static const qint64 SplitMemory = 10 * 60 * 1000;
+
+// a netsplit quit reason names the two servers that lost each other,
+// such as "hub.example.net leaf.example.net"
+// marks the joins and quits of a storm
+static const QString StormTag = QStringLiteral("communi/storm");
+
+static bool isSplitReason(const QString& reason)
+{
+    const int space = reason.indexOf(QLatin1Char(' '));
+    if (space <= 0 || space == reason.length() - 1 || reason.indexOf(QLatin1Char(' '), space + 1) != -1)
+        return false;
+    const int dot1 = reason.indexOf(QLatin1Char('.'));
+    const int dot2 = reason.lastIndexOf(QLatin1Char('.'));
+    return dot1 > 0 && dot1 < space - 1 && dot2 > space + 1 && dot2 < reason.length() - 1;
+}
+
 MessageHandler::MessageHandler(QObject* parent) : QObject(parent)
 {
+    d.mapping = CaseMapping::Rfc1459;
+    d.coalescing = false;
+    d.coalescingInterval = 0;
+    d.coalescingLimit = 1000;
+    d.pendingCount = 0;
+    d.aggregating = false;
+    d.aggregationTimeout = 5000;
+    d.sequence = NoSequence;
+    d.collapsing = false;
+    d.stormWindow = 2000;
+    d.stormThreshold = 10;
+    d.stormClock.start();
+
+    for (int i = 0; i < NumericCount; ++i) {
+        d.replies[i].sequence = NoSequence;
+        d.replies[i].role = NoRole;
+    }
+    for (uint i = 0; i < sizeof(replyTable) / sizeof(replyTable[0]); ++i) {
+        d.replies[replyTable[i].code].sequence = replyTable[i].sequence;
+        d.replies[replyTable[i].code].role = replyTable[i].role;
+    }
+
+    // connection registration replies go to the default buffer, the rest
+    // of the replies and other messages follow the current buffer
+    for (int i = 0; i < TypeCount; ++i)
+        setTypeRoute(IrcMessage::Type(i), CurrentRoute);
+    setTypeRoute(IrcMessage::Motd, DefaultRoute);
+    for (int i = 0; i < NumericCount; ++i)
+        setNumericRoute(i, i < 300 ? DefaultRoute : CurrentRoute);
+    setNumericRoute(Irc::RPL_CHANNEL_URL, ParameterRoute, 1);
+    addServiceRule("ChanServ!ChanServ@services.", "\\[([^\\]]+)\\]");
+
     setModel(qobject_cast<IrcBufferModel*>(parent));
 }
 
 MessageHandler::~MessageHandler()
 {
+    flushReplies();
+    flush();
+    if (d.connection)
+        FilterPipeline::forConnection(d.connection)->removeStage(this);
+}
+
+// Joins and quits are delivered by the buffer model, which keeps the
+// channel and user state from them, so storms are never dropped. The
+// storm stage runs in the connection's filter pipeline ahead of the
+// model and only marks the messages of a storm. The buffers that receive
+// them are summarized once per buffer and timer tick, and views fold the
+// marked messages with isCollapsed().
+bool MessageHandler::messageFilter(IrcMessage* message)
+{
+    if (!d.collapsing || message->flags() & (IrcMessage::Own | IrcMessage::Playback))
+        return false;
+
+    const qint64 now = d.stormClock.elapsed();
+    if (message->type() == IrcMessage::Quit) {
+        if (isSplitReason(static_cast<IrcQuitMessage*>(message)->reason())) {
+            d.splits.insert(CaseMapping::fold(message->nick(), d.mapping), now);
+            message->setTag(StormTag, true);
+        }
+    } else if (message->type() == IrcMessage::Join) {
+        const QString channel = static_cast<IrcJoinMessage*>(message)->channel();
+        if (!d.buffers.contains(CaseMapping::fold(channel, d.mapping)))
+            return false;
+        const bool netjoin = d.splits.contains(CaseMapping::fold(message->nick(), d.mapping));
+        if (isBurst(channel, now) || netjoin)
+            message->setTag(StormTag, true);
+    }
+    return false;
+}
+
+bool MessageHandler::isCollapsed(IrcMessage* message)
+{
+    return message->tags().contains(StormTag);
+}
+
+MessageHandler::Route MessageHandler::numericRoute(int code, int* parameter) const
+{
+    if (code < 0 || code >= NumericCount)
+        return typeRoute(IrcMessage::Numeric, parameter);
+    if (parameter)
+        *parameter = d.numerics[code].parameter;
+    return d.numerics[code].route;
+}
+
+void MessageHandler::setNumericRoute(int code, Route route, int parameter)
+{
+    if (code < 0 || code >= NumericCount)
+        return;
+    d.numerics[code].route = route;
+    d.numerics[code].parameter = parameter;
+}
+
+MessageHandler::Route MessageHandler::typeRoute(IrcMessage::Type type, int* parameter) const
+{
+    if (type < 0 || type >= TypeCount)
+        return CurrentRoute;
+    if (parameter)
+        *parameter = d.types[type].parameter;
+    return d.types[type].route;
+}
+
+void MessageHandler::setTypeRoute(IrcMessage::Type type, Route route, int parameter)
+{
+    if (type < 0 || type >= TypeCount)
+        return;
+    d.types[type].route = route;
+    d.types[type].parameter = parameter;
 }
 
 IrcBufferModel* MessageHandler::model() const
@@ -53,11 +222,27 @@ IrcBufferModel* MessageHandler::model() const
 void MessageHandler::setModel(IrcBufferModel* model)
 {
     if (d.model != model) {
-        if (d.model)
+        if (d.model) {
             disconnect(d.model.data(), &IrcBufferModel::messageIgnored, this, &MessageHandler::handleMessage);
+            disconnect(d.model.data(), &IrcBufferModel::added, this, &MessageHandler::addBuffer);
+            disconnect(d.model.data(), &IrcBufferModel::removed, this, &MessageHandler::removeBuffer);
+            disconnect(d.model.data(), &IrcBufferModel::connectionChanged, this, &MessageHandler::updateCaseMapping);
+            disconnect(d.model.data(), &IrcBufferModel::connectionChanged, this, &MessageHandler::updateConnection);
+            foreach (IrcBuffer* buffer, d.titles.keys())
+                removeBuffer(buffer);
+        }
         d.model = model;
-        if (model)
+        if (model) {
             connect(model, &IrcBufferModel::messageIgnored, this, &MessageHandler::handleMessage);
+            connect(model, &IrcBufferModel::added, this, &MessageHandler::addBuffer);
+            connect(model, &IrcBufferModel::removed, this, &MessageHandler::removeBuffer);
+            connect(model, &IrcBufferModel::connectionChanged, this, &MessageHandler::updateCaseMapping);
+            connect(model, &IrcBufferModel::connectionChanged, this, &MessageHandler::updateConnection);
+            foreach (IrcBuffer* buffer, model->buffers())
+                addBuffer(buffer);
+        }
+        updateCaseMapping();
+        updateConnection();
     }
 }
 
@@ -81,66 +266,513 @@ void MessageHandler::setCurrentBuffer(IrcBuffer* buffer)
     d.currentBuffer = buffer;
 }
 
+bool MessageHandler::isCoalescing() const
+{
+    return d.coalescing;
+}
+
+// In coalescing mode routed messages are queued per buffer and delivered
+// to messagesReceived() together, once per event loop iteration or
+// earlier when the queue hits the limit. Queueing only pays off for a
+// receiver of whole batches, so without one the messages go straight
+// to the buffers.
+void MessageHandler::setCoalescing(bool coalescing)
+{
+    if (d.coalescing != coalescing) {
+        if (!coalescing)
+            flush();
+        d.coalescing = coalescing;
+    }
+}
+
+int MessageHandler::coalescingInterval() const
+{
+    return d.coalescingInterval;
+}
+
+void MessageHandler::setCoalescingInterval(int interval)
+{
+    d.coalescingInterval = qMax(0, interval);
+}
+
+int MessageHandler::coalescingLimit() const
+{
+    return d.coalescingLimit;
+}
+
+void MessageHandler::setCoalescingLimit(int limit)
+{
+    d.coalescingLimit = qMax(1, limit);
+}
+
+// Service rules are kept in a hash by the exact service prefix, so that
+// ordinary notices are passed on after a single lookup. The patterns are
+// anchored at the start of the notice and compiled when they are added.
+bool MessageHandler::addServiceRule(const QString& prefix, const QString& pattern, const QString& target)
+{
+    ServiceRule rule;
+    rule.pattern.setPattern("\\A(?:" + pattern + ")");
+    if (!rule.pattern.isValid() || (target.isEmpty() && rule.pattern.captureCount() < 1)) {
+        qWarning("MessageHandler::addServiceRule(): invalid pattern '%s'", qPrintable(pattern));
+        return false;
+    }
+    rule.pattern.optimize();
+    rule.target = target;
+    d.services[prefix].append(rule);
+    return true;
+}
+
+void MessageHandler::removeServiceRules(const QString& prefix)
+{
+    d.services.remove(prefix);
+}
+
+void MessageHandler::clearServiceRules()
+{
+    d.services.clear();
+}
+
+QStringList MessageHandler::services() const
+{
+    return d.services.keys();
+}
+
+bool MessageHandler::isAggregating() const
+{
+    return d.aggregating;
+}
+
+// Aggregation collects multi-line numeric replies, such as WHOIS or LIST,
+// from the start to the end of the sequence and delivers them in one go.
+// A sequence that stays silent for aggregationTimeout milliseconds is
+// delivered as is.
+void MessageHandler::setAggregating(bool aggregating)
+{
+    if (d.aggregating != aggregating) {
+        if (!aggregating)
+            flushReplies();
+        d.aggregating = aggregating;
+    }
+}
+
+int MessageHandler::aggregationTimeout() const
+{
+    return d.aggregationTimeout;
+}
+
+void MessageHandler::setAggregationTimeout(int timeout)
+{
+    d.aggregationTimeout = qMax(0, timeout);
+}
+
+bool MessageHandler::isCollapsing() const
+{
+    return d.collapsing;
+}
+
+void MessageHandler::setCollapsing(bool collapsing)
+{
+    if (d.collapsing != collapsing) {
+        d.collapsing = collapsing;
+        foreach (IrcBuffer* buffer, d.titles.keys())
+            watchBuffer(buffer, collapsing);
+        if (collapsing) {
+            SharedTimer::instance()->registerReceiver(this, "reportStorms");
+        } else {
+            reportStorms();
+            SharedTimer::instance()->unregisterReceiver(this, "reportStorms");
+            d.splits.clear();
+            d.bursts.clear();
+        }
+        updateConnection();
+    }
+}
+
+int MessageHandler::stormWindow() const
+{
+    return d.stormWindow;
+}
+
+void MessageHandler::setStormWindow(int window)
+{
+    if (d.stormWindow != window) {
+        d.stormWindow = qMax(1, window);
+        d.bursts.clear();
+    }
+}
+
+int MessageHandler::stormThreshold() const
+{
+    return d.stormThreshold;
+}
+
+void MessageHandler::setStormThreshold(int threshold)
+{
+    d.stormThreshold = threshold;
+}
+
+void MessageHandler::flushReplies()
+{
+    d.sequenceTimer.stop();
+    if (d.sequence == NoSequence)
+        return;
+
+    IrcBuffer* buffer = d.sequenceBuffer ? d.sequenceBuffer.data() : d.defaultBuffer.data();
+    const QList<IrcMessage*> messages = d.sequenceMessages;
+    d.sequence = NoSequence;
+    d.sequenceBuffer = 0;
+    d.sequenceMessages.clear();
+
+    if (!buffer) {
+        qDeleteAll(messages);
+    } else if (isBatching()) {
+        foreach (IrcMessage* message, messages)
+            enqueue(buffer, message);
+    } else {
+        deliver(buffer, messages);
+        qDeleteAll(messages);
+    }
+}
+
+void MessageHandler::flush()
+{
+    d.timer.stop();
+    const QVector<Pending> pending = d.pending;
+    d.pending.clear();
+    d.pendingIndex.clear();
+    d.pendingCount = 0;
+
+    foreach (const Pending& p, pending) {
+        if (p.buffer)
+            deliver(p.buffer, p.messages);
+        qDeleteAll(p.messages);
+    }
+}
+
+void MessageHandler::timerEvent(QTimerEvent* event)
+{
+    if (event->timerId() == d.timer.timerId()) {
+        flush();
+    } else if (event->timerId() == d.sequenceTimer.timerId()) {
+        const qint64 remaining = d.aggregationTimeout - d.sequenceActivity.elapsed();
+        if (remaining > 0)
+            d.sequenceTimer.start(remaining, this);
+        else
+            flushReplies();
+    } else {
+        QObject::timerEvent(event);
+    }
+}
+
 void MessageHandler::handleMessage(IrcMessage* message)
 {
-    switch (message->type()) {
-        case IrcMessage::Motd:
-        {
-            sendMessage(message, d.defaultBuffer);
-            break;
+    const LatencyTimer timer(LatencyRecorder::HandlerStage, message->type());
+    CaseMapping::Type mapping;
+    if (CaseMapping::fromMessage(message, &mapping))
+        setCaseMapping(mapping);
+
+    // a message can be sent to several buffers; anything that was not
+    // sent anywhere ends up in the current buffer
+    bool handled = false;
+
+    QHash<QString, QVector<ServiceRule> >::const_iterator service = d.services.constEnd();
+    if (message->type() == IrcMessage::Notice && !d.services.isEmpty())
+        service = d.services.constFind(message->prefix());
+
+    if (service != d.services.constEnd()) {
+        // Forward messages from services to the appropriate buffer
+        const QString content = static_cast<IrcNoticeMessage*>(message)->content();
+        foreach (const ServiceRule& rule, service.value()) {
+            const QRegularExpressionMatch match = rule.pattern.match(content);
+            if (match.hasMatch()) {
+                sendMessage(message, rule.target.isEmpty() ? match.captured(1) : rule.target);
+                handled = true;
+                break;
+            }
         }
-        case IrcMessage::Numeric:
-        {
-            IrcNumericMessage *numMsg = static_cast<IrcNumericMessage*>(message);
-
-            if (numMsg->code() == Irc::RPL_CHANNEL_URL)
-                sendMessage(message, message->parameters().at(1));
-            else if (numMsg->code() < 300)
-                sendMessage(message, d.defaultBuffer);
+    } else {
+        const int type = message->type();
+        const Target* target = type >= 0 && type < TypeCount ? &d.types[type] : &d.types[IrcMessage::Unknown];
+        int code = -1;
+        if (type == IrcMessage::Numeric) {
+            code = static_cast<IrcNumericMessage*>(message)->code();
+            if (code >= 0 && code < NumericCount)
+                target = &d.numerics[code];
             else
-                sendMessage(message, d.currentBuffer);
-            break;
-        }
-        case IrcMessage::Notice:
-        {
-            if (message->prefix() == "ChanServ!ChanServ@services.") {
-                // Forward messages from ChanServ to the appropriate channel
-                QString content = static_cast<IrcNoticeMessage*>(message)->content();
-                if (content.startsWith("[")) {
-                    int i = content.indexOf("]");
-                    if (i != -1) {
-                        QString title = content.mid(1, i - 1);
-                        sendMessage(message, title);
-                    }
-                }
-            }
-            break;
+                code = -1;
         }
-        default:
-        {
-            sendMessage(message, d.currentBuffer);
-            break;
+
+        if (target->route != DropRoute) {
+            IrcBuffer* buffer = findBuffer(message, *target);
+            if (code == -1 || !d.aggregating || !aggregate(message, code, buffer))
+                sendMessage(message, buffer);
         }
+        handled = true;
     }
 
-    if (!message->property("handled").isValid() || !message->property("handled").toBool()) {
+    if (!handled)
         sendMessage(message, d.currentBuffer);
-    }
 }
 
 void MessageHandler::sendMessage(IrcMessage* message, IrcBuffer* buffer)
 {
     if (!buffer)
         buffer = d.defaultBuffer;
-    if (buffer)
+    if (!buffer)
+        return;
+
+    if (!isBatching()) {
+        // what was queued for a receiver that has gone goes first
+        if (d.pendingCount)
+            flush();
         buffer->receiveMessage(message);
+        return;
+    }
+
+    // the connection disposes its messages once they have been
+    // handled, so the queue keeps copies of its own
+    enqueue(buffer, message->clone(this));
+}
 
-    message->setProperty("handled", true);
+bool MessageHandler::isBatching() const
+{
+    static const QMetaMethod signal = QMetaMethod::fromSignal(&MessageHandler::messagesReceived);
+    return d.coalescing && isSignalConnected(signal);
+}
+
+void MessageHandler::enqueue(IrcBuffer* buffer, IrcMessage* message)
+{
+    int index = d.pendingIndex.value(buffer, -1);
+    if (index == -1) {
+        index = d.pending.count();
+        d.pendingIndex.insert(buffer, index);
+        Pending pending;
+        pending.buffer = buffer;
+        d.pending.append(pending);
+    }
+    d.pending[index].messages.append(message);
+
+    if (++d.pendingCount >= d.coalescingLimit)
+        flush();
+    else if (!d.timer.isActive())
+        d.timer.start(d.coalescingInterval, this);
 }
 
 void MessageHandler::sendMessage(IrcMessage* message, const QString& bufferName)
 {
-    IrcBuffer *buffer = d.model->find(bufferName);
+    IrcBuffer *buffer = d.buffers.value(CaseMapping::fold(bufferName, d.mapping));
     sendMessage(message, buffer);
 }
 
+IrcBuffer* MessageHandler::findBuffer(IrcMessage* message, const Target& target) const
+{
+    switch (target.route) {
+        case CurrentRoute:
+            return d.currentBuffer;
+        case ParameterRoute:
+            return d.buffers.value(CaseMapping::fold(message->parameters().value(target.parameter), d.mapping));
+        default:
+            return d.defaultBuffer;
+    }
+}
+
+// Returns false when the reply is not part of a sequence and should be
+// delivered on its own. Replies arrive in order, so at most one sequence
+// is open at a time and any other reply closes it.
+bool MessageHandler::aggregate(IrcMessage* message, int code, IrcBuffer* buffer)
+{
+    const Reply reply = d.replies[code];
+    switch (reply.role) {
+        case StartRole:
+            flushReplies();
+            break;
+        case MemberRole:
+            if (d.sequence != reply.sequence)
+                flushReplies();
+            break;
+        case AnyRole:
+            if (d.sequence == NoSequence)
+                return false;
+            break;
+        case EndRole:
+            if (d.sequence != reply.sequence) {
+                flushReplies();
+                return false;
+            }
+            break;
+        default:
+            flushReplies();
+            return false;
+    }
+
+    if (d.sequence == NoSequence) {
+        d.sequence = reply.sequence;
+        d.sequenceBuffer = buffer;
+    }
+    d.sequenceMessages.append(message->clone(this));
+
+    if (reply.role == EndRole) {
+        flushReplies();
+    } else {
+        d.sequenceActivity.start();
+        if (!d.sequenceTimer.isActive())
+            d.sequenceTimer.start(d.aggregationTimeout, this);
+    }
+    return true;
+}
+
+void MessageHandler::deliver(IrcBuffer* buffer, const QList<IrcMessage*>& messages)
+{
+    static const QMetaMethod signal = QMetaMethod::fromSignal(&MessageHandler::messagesReceived);
+    if (isSignalConnected(signal)) {
+        emit messagesReceived(buffer, messages);
+    } else {
+        foreach (IrcMessage* message, messages)
+            buffer->receiveMessage(message);
+    }
+}
+
+// Buffers are looked up by their title folded with the network's
+// CASEMAPPING. The hash follows the model instead of searching it.
+void MessageHandler::addBuffer(IrcBuffer* buffer)
+{
+    indexBuffer(buffer);
+    connect(buffer, &IrcBuffer::titleChanged, this, &MessageHandler::renameBuffer);
+    watchBuffer(buffer, d.collapsing);
+}
+
+void MessageHandler::removeBuffer(IrcBuffer* buffer)
+{
+    disconnect(buffer, &IrcBuffer::titleChanged, this, &MessageHandler::renameBuffer);
+    watchBuffer(buffer, false);
+    const QString title = d.titles.take(buffer);
+    if (d.buffers.value(title) == buffer)
+        d.buffers.remove(title);
+}
+
+void MessageHandler::renameBuffer()
+{
+    IrcBuffer* buffer = qobject_cast<IrcBuffer*>(sender());
+    if (buffer && d.titles.contains(buffer))
+        indexBuffer(buffer);
+}
+
+void MessageHandler::indexBuffer(IrcBuffer* buffer)
+{
+    QHash<IrcBuffer*, QString>::iterator it = d.titles.find(buffer);
+    if (it != d.titles.end() && d.buffers.value(it.value()) == buffer)
+        d.buffers.remove(it.value());
+    const QString title = CaseMapping::fold(buffer->title(), d.mapping);
+    d.buffers.insert(title, buffer);
+    d.titles.insert(buffer, title);
+}
+
+// the model knows which channels and queries a quit goes to, so the
+// storms are collected from what the buffers receive
+void MessageHandler::watchBuffer(IrcBuffer* buffer, bool watch)
+{
+    if (watch)
+        connect(buffer, &IrcBuffer::messageReceived, this, &MessageHandler::collectStorm, Qt::UniqueConnection);
+    else
+        disconnect(buffer, &IrcBuffer::messageReceived, this, &MessageHandler::collectStorm);
+}
+
+void MessageHandler::collectStorm(IrcMessage* message)
+{
+    if (message->type() != IrcMessage::Join && message->type() != IrcMessage::Quit)
+        return;
+    IrcBuffer* buffer = qobject_cast<IrcBuffer*>(sender());
+    if (buffer && isCollapsed(message))
+        collapse(buffer, message);
+}
+
+// a handler attached after registration has missed RPL_ISUPPORT
+void MessageHandler::updateCaseMapping()
+{
+    CaseMapping::Type mapping = CaseMapping::Rfc1459;
+    if (d.model)
+        CaseMapping::fromNetwork(d.model->network(), &mapping);
+    setCaseMapping(mapping);
+}
+
+void MessageHandler::updateConnection()
+{
+    IrcConnection* connection = d.collapsing && d.model ? d.model->connection() : 0;
+    if (d.connection != connection) {
+        if (d.connection)
+            FilterPipeline::forConnection(d.connection)->removeStage(this);
+        d.connection = connection;
+        // the pipeline runs ahead of the model, so the marks are in place
+        // before the buffers receive the messages
+        if (connection)
+            FilterPipeline::forConnection(connection)->addStage("storm", this, (1 << IrcMessage::Join) | (1 << IrcMessage::Quit));
+    }
+}
+
+void MessageHandler::collapse(IrcBuffer* buffer, IrcMessage* message)
+{
+    const QPair<IrcBuffer*, int> key(buffer, message->type());
+    int index = d.stormIndex.value(key, -1);
+    if (index == -1) {
+        index = d.storms.count();
+        d.stormIndex.insert(key, index);
+        Storm storm;
+        storm.buffer = buffer;
+        storm.type = message->type();
+        if (message->type() == IrcMessage::Quit)
+            storm.reason = static_cast<IrcQuitMessage*>(message)->reason();
+        d.storms.append(storm);
+    }
+    d.storms[index].nicks.append(message->nick());
+}
+
+void MessageHandler::reportStorms()
+{
+    const QVector<Storm> storms = d.storms;
+    d.storms.clear();
+    d.stormIndex.clear();
+
+    const qint64 now = d.stormClock.elapsed();
+    QMutableHashIterator<QString, qint64> it(d.splits);
+    while (it.hasNext()) {
+        if (now - it.next().value() > SplitMemory)
+            it.remove();
+    }
+    const qint64 window = now / d.stormWindow;
+    QMutableHashIterator<QString, Burst> bt(d.bursts);
+    while (bt.hasNext()) {
+        if (bt.next().value().window < window)
+            bt.remove();
+    }
+
+    foreach (const Storm& storm, storms) {
+        if (storm.buffer)
+            emit stormCollapsed(storm.buffer, storm.type, storm.nicks, storm.reason);
+    }
+}
+
+// joins are counted per channel in fixed windows of stormWindow
+bool MessageHandler::isBurst(const QString& channel, qint64 now)
+{
+    if (d.stormThreshold <= 0)
+        return false;
+
+    const qint64 window = now / d.stormWindow;
+    Burst& burst = d.bursts[CaseMapping::fold(channel, d.mapping)];
+    if (burst.window != window) {
+        burst.window = window;
+        burst.count = 0;
+    }
+    return ++burst.count > d.stormThreshold;
+}
+
+void MessageHandler::setCaseMapping(CaseMapping::Type mapping)
+{
+    if (d.mapping != mapping) {
+        d.mapping = mapping;
+        d.buffers.clear();
+        foreach (IrcBuffer* buffer, d.titles.keys())
+            indexBuffer(buffer);
+    }
+}
+
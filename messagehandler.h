@@ -30,43 +30,206 @@
 #define MESSAGEHANDLER_H
 
 #include <QObject>
+#include <QHash>
+#include <QPair>
+#include <QList>
+#include <QStringList>
+#include <QRegularExpression>
+#include <QVector>
 #include <QPointer>
+#include <QBasicTimer>
+#include <QElapsedTimer>
 #include <IrcGlobal>
+#include <IrcMessage>
+#include <IrcMessageFilter>
+#include "casemapping.h"
 #include "sharedglobal.h"
 
 IRC_FORWARD_DECLARE_CLASS(IrcBuffer)
 IRC_FORWARD_DECLARE_CLASS(IrcMessage)
 IRC_FORWARD_DECLARE_CLASS(IrcBufferModel)
+IRC_FORWARD_DECLARE_CLASS(IrcConnection)
 
-class SHARED_EXPORT MessageHandler : public QObject
+class SHARED_EXPORT MessageHandler : public QObject, public IrcMessageFilter
 {
     Q_OBJECT
+    Q_INTERFACES(IrcMessageFilter)
+    Q_PROPERTY(bool coalescing READ isCoalescing WRITE setCoalescing)
+    Q_PROPERTY(int coalescingInterval READ coalescingInterval WRITE setCoalescingInterval)
+    Q_PROPERTY(int coalescingLimit READ coalescingLimit WRITE setCoalescingLimit)
+    Q_PROPERTY(bool aggregating READ isAggregating WRITE setAggregating)
+    Q_PROPERTY(int aggregationTimeout READ aggregationTimeout WRITE setAggregationTimeout)
+    Q_PROPERTY(bool collapsing READ isCollapsing WRITE setCollapsing)
+    Q_PROPERTY(int stormWindow READ stormWindow WRITE setStormWindow)
+    Q_PROPERTY(int stormThreshold READ stormThreshold WRITE setStormThreshold)
 
 public:
     explicit MessageHandler(QObject* parent = 0);
     virtual ~MessageHandler();
 
+    enum Route {
+        DefaultRoute,
+        CurrentRoute,
+        ParameterRoute,
+        DropRoute
+    };
+
+    bool messageFilter(IrcMessage* message);
+    static bool isCollapsed(IrcMessage* message);
+
+    Route numericRoute(int code, int* parameter = 0) const;
+    void setNumericRoute(int code, Route route, int parameter = 0);
+
+    Route typeRoute(IrcMessage::Type type, int* parameter = 0) const;
+    void setTypeRoute(IrcMessage::Type type, Route route, int parameter = 0);
+
     IrcBufferModel* model() const;
     void setModel(IrcBufferModel* model);
 
     IrcBuffer* defaultBuffer() const;
     IrcBuffer* currentBuffer() const;
 
+    bool isCoalescing() const;
+    void setCoalescing(bool coalescing);
+
+    int coalescingInterval() const;
+    void setCoalescingInterval(int interval);
+
+    int coalescingLimit() const;
+    void setCoalescingLimit(int limit);
+
+    bool addServiceRule(const QString& prefix, const QString& pattern, const QString& target = QString());
+    void removeServiceRules(const QString& prefix);
+    void clearServiceRules();
+    QStringList services() const;
+
+    bool isAggregating() const;
+    void setAggregating(bool aggregating);
+
+    int aggregationTimeout() const;
+    void setAggregationTimeout(int timeout);
+
+    bool isCollapsing() const;
+    void setCollapsing(bool collapsing);
+
+    int stormWindow() const;
+    void setStormWindow(int window);
+
+    int stormThreshold() const;
+    void setStormThreshold(int threshold);
+
 public slots:
     void setDefaultBuffer(IrcBuffer* buffer);
     void setCurrentBuffer(IrcBuffer* buffer);
 
+    void flush();
+    void flushReplies();
+
+signals:
+    void messagesReceived(IrcBuffer* buffer, const QList<IrcMessage*>& messages);
+    void stormCollapsed(IrcBuffer* buffer, IrcMessage::Type type, const QStringList& nicks, const QString& reason);
+
+protected:
+    void timerEvent(QTimerEvent* event);
+
 protected slots:
     void handleMessage(IrcMessage* message);
 
+private slots:
+    void addBuffer(IrcBuffer* buffer);
+    void removeBuffer(IrcBuffer* buffer);
+    void renameBuffer();
+    void collectStorm(IrcMessage* message);
+    void updateCaseMapping();
+    void updateConnection();
+    void reportStorms();
+
 private:
     void sendMessage(IrcMessage* message, IrcBuffer* buffer);
     void sendMessage(IrcMessage* message, const QString& buffer);
+    void setCaseMapping(CaseMapping::Type mapping);
+    bool aggregate(IrcMessage* message, int code, IrcBuffer* buffer);
+    bool isBatching() const;
+    void enqueue(IrcBuffer* buffer, IrcMessage* message);
+    void deliver(IrcBuffer* buffer, const QList<IrcMessage*>& messages);
+    bool isBurst(const QString& channel, qint64 now);
+    void indexBuffer(IrcBuffer* buffer);
+    void watchBuffer(IrcBuffer* buffer, bool watch);
+    void collapse(IrcBuffer* buffer, IrcMessage* message);
+
+    // a notice from the service prefix whose content matches the pattern
+    // goes to the target buffer, or the buffer captured by the pattern
+    struct ServiceRule {
+        QRegularExpression pattern;
+        QString target;
+    };
+
+    // collapsed messages of one type in one buffer since the last report
+    struct Storm {
+        QPointer<IrcBuffer> buffer;
+        IrcMessage::Type type;
+        QStringList nicks;
+        QString reason;
+    };
+
+    struct Burst {
+        qint64 window;
+        int count;
+    };
+
+    struct Pending {
+        QPointer<IrcBuffer> buffer;
+        QList<IrcMessage*> messages;
+    };
+
+    struct Target {
+        Route route;
+        int parameter;
+    };
+    IrcBuffer* findBuffer(IrcMessage* message, const Target& target) const;
+
+    enum { NumericCount = 1000, TypeCount = 32 };
+
+    // multi-line replies, see the reply table in messagehandler.cpp
+    struct Reply {
+        quint8 sequence;
+        quint8 role;
+    };
 
     struct Private {
         QPointer<IrcBufferModel> model;
         QPointer<IrcBuffer> defaultBuffer;
         QPointer<IrcBuffer> currentBuffer;
+        CaseMapping::Type mapping;
+        QHash<QString, IrcBuffer*> buffers;
+        QHash<IrcBuffer*, QString> titles;
+        Target numerics[NumericCount];
+        Target types[TypeCount];
+        QHash<QString, QVector<ServiceRule> > services;
+        bool coalescing;
+        int coalescingInterval;
+        int coalescingLimit;
+        int pendingCount;
+        QBasicTimer timer;
+        QVector<Pending> pending;
+        QHash<IrcBuffer*, int> pendingIndex;
+        bool aggregating;
+        int aggregationTimeout;
+        Reply replies[NumericCount];
+        int sequence;
+        QPointer<IrcBuffer> sequenceBuffer;
+        QList<IrcMessage*> sequenceMessages;
+        QElapsedTimer sequenceActivity;
+        QBasicTimer sequenceTimer;
+        bool collapsing;
+        int stormWindow;
+        int stormThreshold;
+        QElapsedTimer stormClock;
+        QPointer<IrcConnection> connection;
+        QHash<QString, qint64> splits;
+        QHash<QString, Burst> bursts;
+        QVector<Storm> storms;
+        QHash<QPair<IrcBuffer*, int>, int> stormIndex;
     } d;
 };
 
@@ -6,14 +6,26 @@ DEPENDPATH += $$PWD
 INCLUDEPATH += $$PWD
 DEFINES += BUILD_SHARED
 
+HEADERS += $$PWD/casemapping.h
+HEADERS += $$PWD/contentmatcher.h
+HEADERS += $$PWD/filterpipeline.h
+HEADERS += $$PWD/floodmanager.h
+HEADERS += $$PWD/ignoreindex.h
 HEADERS += $$PWD/ignoremanager.h
+HEADERS += $$PWD/latencyrecorder.h
 HEADERS += $$PWD/messagehandler.h
 HEADERS += $$PWD/networksession.h
 HEADERS += $$PWD/sharedglobal.h
 HEADERS += $$PWD/sharedtimer.h
 HEADERS += $$PWD/zncmanager.h
 
+SOURCES += $$PWD/casemapping.cpp
+SOURCES += $$PWD/contentmatcher.cpp
+SOURCES += $$PWD/filterpipeline.cpp
+SOURCES += $$PWD/floodmanager.cpp
+SOURCES += $$PWD/ignoreindex.cpp
 SOURCES += $$PWD/ignoremanager.cpp
+SOURCES += $$PWD/latencyrecorder.cpp
 SOURCES += $$PWD/messagehandler.cpp
 SOURCES += $$PWD/networksession.cpp
 SOURCES += $$PWD/sharedtimer.cpp
@@ -0,0 +1,7 @@
+######################################################################
+# Communi
+######################################################################
+
+SOURCES += tst_filterpipeline.cpp
+
+include(../tests.pri)
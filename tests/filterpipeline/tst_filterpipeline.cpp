@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2008-2016 The Communi Project
+ *
+ * This test is free, and not covered by the BSD license. There is no
+ * restriction applied to their modification, redistribution, using and so on.
+ * You can study them, modify them, use them in your own program - either
+ * completely or partially.
+ */
+
+#include "filterpipeline.h"
+#include "floodmanager.h"
+#include "ignoremanager.h"
+#include "zncmanager.h"
+#include <IrcBufferModel>
+#include <IrcConnection>
+#include <IrcMessage>
+#include <QtTest/QtTest>
+
+class TestFilter : public IrcMessageFilter
+{
+public:
+    TestFilter(const QString& name, QStringList* log, bool drop = false) : name(name), log(log), drop(drop) { }
+
+    bool messageFilter(IrcMessage*)
+    {
+        *log += name;
+        return drop;
+    }
+
+    QString name;
+    QStringList* log;
+    bool drop;
+};
+
+class tst_FilterPipeline : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void testOrder();
+    void testTypes();
+    void testStatistics();
+    void testConnection();
+};
+
+void tst_FilterPipeline::testOrder()
+{
+    QStringList log;
+    TestFilter a("a", &log), b("b", &log, true), c("c", &log);
+
+    FilterPipeline pipeline;
+    pipeline.addStage("b", &b);
+    pipeline.addStage("c", &c);
+    pipeline.insertStage(0, "a", &a);
+    pipeline.addStage("a again", &a);
+    QCOMPARE(pipeline.stages(), QStringList() << "a" << "b" << "c");
+
+    IrcConnection connection;
+    IrcMessage* message = IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :hi", &connection);
+
+    // the first drop ends the pipeline
+    QVERIFY(pipeline.messageFilter(message));
+    QCOMPARE(log, QStringList() << "a" << "b");
+
+    log.clear();
+    pipeline.removeStage(&b);
+    QVERIFY(!pipeline.messageFilter(message));
+    QCOMPARE(log, QStringList() << "a" << "c");
+}
+
+void tst_FilterPipeline::testTypes()
+{
+    QStringList log;
+    TestFilter priv("private", &log), join("join", &log);
+
+    FilterPipeline pipeline;
+    pipeline.addStage("private", &priv, 1 << IrcMessage::Private);
+    pipeline.addStage("join", &join, 1 << IrcMessage::Join);
+    QCOMPARE(pipeline.stageTypes("join"), uint(1 << IrcMessage::Join));
+
+    IrcConnection connection;
+    pipeline.messageFilter(IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :hi", &connection));
+    pipeline.messageFilter(IrcMessage::fromData(":nick!ident@host JOIN #chan", &connection));
+    pipeline.messageFilter(IrcMessage::fromData(":nick!ident@host PART #chan", &connection));
+    QCOMPARE(log, QStringList() << "private" << "join");
+}
+
+void tst_FilterPipeline::testStatistics()
+{
+    QStringList log;
+    TestFilter pass("pass", &log), drop("drop", &log, true);
+
+    FilterPipeline pipeline;
+    pipeline.addStage("pass", &pass);
+    pipeline.addStage("drop", &drop, 1 << IrcMessage::Notice);
+
+    IrcConnection connection;
+    for (int i = 0; i < 3; ++i)
+        pipeline.messageFilter(IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :hi", &connection));
+    pipeline.messageFilter(IrcMessage::fromData(":nick!ident@host NOTICE #chan :hi", &connection));
+
+    QCOMPARE(pipeline.stagePassed("pass"), qint64(4));
+    QCOMPARE(pipeline.stageDropped("pass"), qint64(0));
+    QCOMPARE(pipeline.stagePassed("drop"), qint64(0));
+    QCOMPARE(pipeline.stageDropped("drop"), qint64(1));
+    QVERIFY(pipeline.stageTime("pass") > 0);
+
+    pipeline.resetStatistics();
+    QCOMPARE(pipeline.stagePassed("pass"), qint64(0));
+    QCOMPARE(pipeline.stageTime("pass"), qint64(0));
+}
+
+void tst_FilterPipeline::testConnection()
+{
+    IrcConnection connection;
+    IrcBufferModel model;
+    model.setConnection(&connection);
+
+    FloodManager flood;
+    flood.addConnection(&connection);
+    IgnoreManager::instance()->addConnection(&connection);
+    ZncManager znc;
+    znc.setModel(&model);
+
+    // one pipeline per connection, with the ignores evaluated once
+    FilterPipeline* pipeline = FilterPipeline::forConnection(&connection);
+    QCOMPARE(connection.findChildren<FilterPipeline*>().count(), 1);
+    QCOMPARE(pipeline->stages(), QStringList() << "znc" << "flood" << "ignore");
+
+    IgnoreManager::instance()->setIgnores(QStringList() << "nick");
+    IrcMessage* message = IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :hi", &connection);
+    QVERIFY(pipeline->messageFilter(message));
+    QCOMPARE(pipeline->stageDropped("ignore"), qint64(1));
+    QCOMPARE(IgnoreManager::instance()->hitCount("nick"), 1);
+
+    IgnoreManager::instance()->setIgnores(QStringList());
+
+    // the ignore stage was added by hand and stays
+    znc.setModel(0);
+    QCOMPARE(pipeline->stages(), QStringList() << "flood" << "ignore");
+    IgnoreManager::instance()->removeConnection(&connection);
+    QCOMPARE(pipeline->stages(), QStringList() << "flood");
+
+    // the ignore stage added by the manager goes with it
+    znc.setModel(&model);
+    QCOMPARE(pipeline->stages(), QStringList() << "znc" << "flood" << "ignore");
+    znc.setModel(0);
+    QCOMPARE(pipeline->stages(), QStringList() << "flood");
+}
+
+QTEST_MAIN(tst_FilterPipeline)
+
+#include "tst_filterpipeline.moc"
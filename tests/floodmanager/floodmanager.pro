@@ -0,0 +1,7 @@
+######################################################################
+# Communi
+######################################################################
+
+SOURCES += tst_floodmanager.cpp
+
+include(../tests.pri)
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2008-2016 The Communi Project
+ *
+ * This test is free, and not covered by the BSD license. There is no
+ * restriction applied to their modification, redistribution, using and so on.
+ * You can study them, modify them, use them in your own program - either
+ * completely or partially.
+ */
+
+#include "floodmanager.h"
+#include <IrcConnection>
+#include <IrcMessage>
+#include <QtTest/QtTest>
+
+class tst_FloodManager : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void testPrefix();
+    void testHost();
+    void testPlayback();
+    void testStaleNeighbour();
+
+private:
+    IrcConnection* connection;
+};
+
+void tst_FloodManager::init()
+{
+    connection = new IrcConnection(this);
+}
+
+void tst_FloodManager::cleanup()
+{
+    delete connection;
+}
+
+void tst_FloodManager::testPrefix()
+{
+    FloodManager manager;
+    manager.setInterval(60000);
+    manager.setPrefixThreshold(3);
+    QSignalSpy spy(&manager, SIGNAL(messagesShed(QString,int)));
+
+    IrcMessage* flood = IrcMessage::fromData(":flood!ident@host PRIVMSG #chan :spam", connection);
+    IrcMessage* other = IrcMessage::fromData(":other!ident@other PRIVMSG #chan :hi", connection);
+    for (int i = 0; i < 3; ++i)
+        QVERIFY(!manager.messageFilter(flood));
+    QVERIFY(manager.messageFilter(flood));
+    QVERIFY(manager.messageFilter(flood));
+    QVERIFY(!manager.messageFilter(other));
+
+    QTRY_COMPARE(spy.count(), 1);
+    QCOMPARE(spy.first().at(0).toString(), QString("flood!ident@host"));
+    QCOMPARE(spy.first().at(1).toInt(), 2);
+}
+
+void tst_FloodManager::testHost()
+{
+    FloodManager manager;
+    manager.setInterval(60000);
+    manager.setHostThreshold(3);
+    QSignalSpy spy(&manager, SIGNAL(messagesShed(QString,int)));
+
+    // joins count towards the flood, but channel state needs them
+    for (int i = 0; i < 5; ++i) {
+        IrcMessage* message = IrcMessage::fromData(":bot" + QByteArray::number(i) + "!ident@botnet JOIN #chan", connection);
+        QVERIFY(!manager.messageFilter(message));
+    }
+    for (int i = 0; i < 2; ++i) {
+        IrcMessage* message = IrcMessage::fromData(":bot" + QByteArray::number(i) + "!ident@botnet PRIVMSG #chan :spam", connection);
+        QVERIFY(manager.messageFilter(message));
+    }
+    QVERIFY(!manager.messageFilter(IrcMessage::fromData(":bot0!ident@botnet QUIT :bye", connection)));
+
+    QTRY_COMPARE(spy.count(), 1);
+    QCOMPARE(spy.first().at(0).toString(), QString("*!*@botnet"));
+    QCOMPARE(spy.first().at(1).toInt(), 2);
+}
+
+void tst_FloodManager::testPlayback()
+{
+    FloodManager manager;
+    manager.setPrefixThreshold(1);
+
+    IrcMessage* message = IrcMessage::fromData(":flood!ident@host PRIVMSG #chan :spam", connection);
+    message->setFlags(message->flags() | IrcMessage::Playback);
+    for (int i = 0; i < 5; ++i)
+        QVERIFY(!manager.messageFilter(message));
+}
+
+// A flooding source placed after a neighbour that collides with it must
+// keep its counter once the neighbour goes stale.
+void tst_FloodManager::testStaleNeighbour()
+{
+    // the counter tables have 1024 slots
+    const QString neighbour = "neighbour!ident@host";
+    const uint slot = (qHash(neighbour) | 1) % 1024;
+    QString flood;
+    for (int i = 0; flood.isEmpty(); ++i) {
+        const QString source = "flood" + QString::number(i) + "!ident@host";
+        if ((qHash(source) | 1) % 1024 == slot)
+            flood = source;
+    }
+
+    QElapsedTimer clock;
+    FloodManager manager;
+    clock.start();
+    manager.setInterval(1000);
+    manager.setPrefixThreshold(4);
+
+    IrcMessage* first = IrcMessage::fromData(":" + neighbour.toUtf8() + " PRIVMSG #chan :hi", connection);
+    IrcMessage* second = IrcMessage::fromData(":" + flood.toUtf8() + " PRIVMSG #chan :spam", connection);
+
+    // window 0: the neighbour takes the slot, the flood goes next to it
+    QVERIFY(!manager.messageFilter(first));
+    QVERIFY(!manager.messageFilter(second));
+
+    // window 1
+    QTest::qWait(1050 - clock.elapsed());
+    for (int i = 0; i < 4; ++i)
+        QVERIFY(!manager.messageFilter(second));
+
+    // window 2: the neighbour is stale, the flood still counts its last window
+    QTest::qWait(2050 - clock.elapsed());
+    QVERIFY(!manager.messageFilter(second));
+    QVERIFY(manager.messageFilter(second));
+}
+
+QTEST_MAIN(tst_FloodManager)
+
+#include "tst_floodmanager.moc"
@@ -0,0 +1,7 @@
+######################################################################
+# Communi
+######################################################################
+
+SOURCES += tst_ignoremanager.cpp
+
+include(../tests.pri)
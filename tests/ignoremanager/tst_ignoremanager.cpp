@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2008-2016 The Communi Project
+ *
+ * This test is free, and not covered by the BSD license. There is no
+ * restriction applied to their modification, redistribution, using and so on.
+ * You can study them, modify them, use them in your own program - either
+ * completely or partially.
+ */
+
+#include "ignoremanager.h"
+#include <IrcConnection>
+#include <IrcMessage>
+#include <QtTest/QtTest>
+#include <QThread>
+
+class FilterThread : public QThread
+{
+public:
+    QList<IrcMessage*> messages;
+    int ignored = 0;
+
+protected:
+    void run()
+    {
+        foreach (IrcMessage* message, messages)
+            ignored += IgnoreManager::instance()->messageFilter(message);
+    }
+};
+
+class tst_IgnoreManager : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void testFilter_data();
+    void testFilter();
+
+    void testAddRemove();
+    void testCache();
+    void testCaseMapping_data();
+    void testCaseMapping();
+    void testHitCount();
+    void testExpiry();
+    void testSnapshot();
+    void testContentRules_data();
+    void testContentRules();
+    void testContentRuleChanges();
+    void testUpdate();
+
+    void testBenchmark_data();
+    void testBenchmark();
+    void testChangeBenchmark_data();
+    void testChangeBenchmark();
+
+    void testConcurrency();
+    void testConcurrencyBenchmark_data();
+    void testConcurrencyBenchmark();
+
+private:
+    IrcConnection* connection;
+};
+
+void tst_IgnoreManager::init()
+{
+    connection = new IrcConnection(this);
+}
+
+void tst_IgnoreManager::cleanup()
+{
+    IgnoreManager::instance()->setIgnores(QStringList());
+    IgnoreManager::instance()->setCacheSize(1024);
+    delete connection;
+}
+
+void tst_IgnoreManager::testFilter_data()
+{
+    QTest::addColumn<QStringList>("ignores");
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("ignored");
+
+    QTest::newRow("none") << QStringList() << QByteArray(":nick!ident@host PRIVMSG #chan :hi") << false;
+    QTest::newRow("nick") << (QStringList() << "nick") << QByteArray(":nick!ident@host PRIVMSG #chan :hi") << true;
+    QTest::newRow("other nick") << (QStringList() << "nick") << QByteArray(":nick2!ident@host PRIVMSG #chan :hi") << false;
+    QTest::newRow("case") << (QStringList() << "NiCk") << QByteArray(":nIcK!ident@host NOTICE #chan :hi") << true;
+    QTest::newRow("host") << (QStringList() << "*!*@*.example.com") << QByteArray(":nick!ident@spam.example.com PRIVMSG #chan :hi") << true;
+    QTest::newRow("ident") << (QStringList() << "*!?dent@*") << QByteArray(":nick!ident@host PRIVMSG #chan :hi") << true;
+    QTest::newRow("brackets") << (QStringList() << "RDash[AW]") << QByteArray(":RDash[AW]!ident@host PRIVMSG #chan :hi") << true;
+    QTest::newRow("ipv4 cidr") << (QStringList() << "*!*@198.51.100.0/22") << QByteArray(":nick!ident@198.51.103.42 PRIVMSG #chan :hi") << true;
+    QTest::newRow("ipv4 outside cidr") << (QStringList() << "*!*@198.51.100.0/22") << QByteArray(":nick!ident@198.51.104.1 PRIVMSG #chan :hi") << false;
+    QTest::newRow("ipv4 cidr nick") << (QStringList() << "bot*!*@10.0.0.0/8") << QByteArray(":nick!ident@10.1.2.3 PRIVMSG #chan :hi") << false;
+    QTest::newRow("ipv6 cidr") << (QStringList() << "*!*@2001:db8:abcd::/48") << QByteArray(":nick!ident@2001:db8:abcd:12::1 PRIVMSG #chan :hi") << true;
+    QTest::newRow("ipv6 outside cidr") << (QStringList() << "*!*@2001:db8:abcd::/48") << QByteArray(":nick!ident@2001:db8:abce::1 PRIVMSG #chan :hi") << false;
+    QTest::newRow("hostname cidr") << (QStringList() << "*!*@198.51.100.0/22") << QByteArray(":nick!ident@198.51.100.example.com PRIVMSG #chan :hi") << false;
+    QTest::newRow("join") << (QStringList() << "nick") << QByteArray(":nick!ident@host JOIN #chan") << false;
+}
+
+void tst_IgnoreManager::testFilter()
+{
+    QFETCH(QStringList, ignores);
+    QFETCH(QByteArray, data);
+    QFETCH(bool, ignored);
+
+    IgnoreManager::instance()->setIgnores(ignores);
+
+    IrcMessage* message = IrcMessage::fromData(data, connection);
+    QVERIFY(message);
+    QCOMPARE(IgnoreManager::instance()->messageFilter(message), ignored);
+}
+
+void tst_IgnoreManager::testAddRemove()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    manager->setIgnores(QStringList() << "foo" << "*!*@bar" << "foo!*@*");
+    QCOMPARE(manager->ignores(), QStringList() << "foo!*@*" << "*!*@bar");
+
+    QCOMPARE(manager->addIgnore("*!baz@*"), QString("*!baz@*"));
+    QCOMPARE(manager->addIgnore("*!baz@*"), QString("*!baz@*"));
+    QCOMPARE(manager->ignores().count(), 3);
+
+    IrcMessage* message = IrcMessage::fromData(":nick!baz@host PRIVMSG #chan :hi", connection);
+    QVERIFY(manager->messageFilter(message));
+
+    QCOMPARE(manager->removeIgnore("*!baz@*"), QString("*!baz@*"));
+    QVERIFY(!manager->messageFilter(message));
+    QCOMPARE(manager->ignores(), QStringList() << "foo!*@*" << "*!*@bar");
+}
+
+void tst_IgnoreManager::testCache()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    manager->setIgnores(QStringList() << "foo");
+    manager->resetCacheStatistics();
+
+    IrcMessage* foo = IrcMessage::fromData(":foo!ident@host PRIVMSG #chan :hi", connection);
+    IrcMessage* bar = IrcMessage::fromData(":bar!ident@host PRIVMSG #chan :hi", connection);
+
+    QVERIFY(manager->messageFilter(foo));
+    QVERIFY(!manager->messageFilter(bar));
+    QCOMPARE(manager->cacheMisses(), qint64(2));
+    QCOMPARE(manager->cacheHits(), qint64(0));
+
+    QVERIFY(manager->messageFilter(foo));
+    QVERIFY(!manager->messageFilter(bar));
+    QCOMPARE(manager->cacheMisses(), qint64(2));
+    QCOMPARE(manager->cacheHits(), qint64(2));
+
+    manager->addIgnore("bar");
+    QVERIFY(manager->messageFilter(bar));
+    QVERIFY(manager->messageFilter(foo));
+    QCOMPARE(manager->cacheMisses(), qint64(3));
+    QCOMPARE(manager->cacheHits(), qint64(3));
+
+    manager->removeIgnore("foo");
+    QVERIFY(!manager->messageFilter(foo));
+    QVERIFY(manager->messageFilter(bar));
+    QCOMPARE(manager->cacheMisses(), qint64(4));
+    QCOMPARE(manager->cacheHits(), qint64(4));
+
+    manager->setIgnores(QStringList());
+    QVERIFY(!manager->messageFilter(bar));
+    QCOMPARE(manager->cacheMisses(), qint64(5));
+}
+
+void tst_IgnoreManager::testCaseMapping_data()
+{
+    QTest::addColumn<QString>("mapping");
+    QTest::addColumn<QString>("ignore");
+    QTest::addColumn<QByteArray>("prefix");
+    QTest::addColumn<bool>("ignored");
+
+    QTest::newRow("rfc1459 brackets") << "rfc1459" << "foo[a]" << QByteArray("FOO{A}!x@y") << true;
+    QTest::newRow("rfc1459 backslash") << "rfc1459" << "a\\b" << QByteArray("A|B!x@y") << true;
+    QTest::newRow("rfc1459 tilde") << "rfc1459" << "a~" << QByteArray("A^!x@y") << true;
+    QTest::newRow("strict-rfc1459 brackets") << "strict-rfc1459" << "foo[a]" << QByteArray("foo{a}!x@y") << true;
+    QTest::newRow("strict-rfc1459 tilde") << "strict-rfc1459" << "a~" << QByteArray("a^!x@y") << false;
+    QTest::newRow("ascii brackets") << "ascii" << "foo[a]" << QByteArray("foo{a}!x@y") << false;
+    QTest::newRow("ascii case") << "ascii" << "FOO" << QByteArray("foo!x@y") << true;
+    QTest::newRow("ascii latin1") << "ascii" << QString::fromUtf8("\xc3\x84") << QByteArray("\xc3\xa4!x@y") << false;
+}
+
+void tst_IgnoreManager::testCaseMapping()
+{
+    QFETCH(QString, mapping);
+    QFETCH(QString, ignore);
+    QFETCH(QByteArray, prefix);
+    QFETCH(bool, ignored);
+
+    IgnoreManager* manager = IgnoreManager::instance();
+    manager->messageFilter(IrcMessage::fromData(":irc.server.com 005 nick CASEMAPPING=" + mapping.toUtf8() + " :are supported by this server", connection));
+    manager->setIgnores(QStringList() << ignore);
+
+    IrcMessage* message = IrcMessage::fromData(":" + prefix + " PRIVMSG #chan :hi", connection);
+    QCOMPARE(manager->messageFilter(message), ignored);
+}
+
+void tst_IgnoreManager::testHitCount()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    manager->setIgnores(QStringList() << "foo" << "bar");
+
+    IrcMessage* foo = IrcMessage::fromData(":foo!ident@host PRIVMSG #chan :hi", connection);
+    IrcMessage* baz = IrcMessage::fromData(":baz!ident@host PRIVMSG #chan :hi", connection);
+    for (int i = 0; i < 3; ++i) {
+        manager->messageFilter(foo);
+        manager->messageFilter(baz);
+    }
+
+    QCOMPARE(manager->hitCount("foo"), 3);
+    QCOMPARE(manager->hitCount("bar"), 0);
+    QCOMPARE(manager->hitCount("baz"), 0);
+
+    manager->setIgnores(QStringList() << "foo");
+    QCOMPARE(manager->hitCount("foo"), 3);
+
+    manager->resetHitCounts();
+    QCOMPARE(manager->hitCount("foo"), 0);
+}
+
+void tst_IgnoreManager::testExpiry()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    QSignalSpy spy(manager, SIGNAL(ignoreExpired(QString)));
+
+    manager->addIgnore("foo", 1);
+    manager->addIgnore("bar");
+    QVERIFY(manager->remainingTime("foo") >= 0);
+    QCOMPARE(manager->remainingTime("bar"), -1);
+
+    IrcMessage* foo = IrcMessage::fromData(":foo!ident@host PRIVMSG #chan :hi", connection);
+    QVERIFY(manager->messageFilter(foo));
+
+    QTRY_COMPARE_WITH_TIMEOUT(spy.count(), 1, 3000);
+    QCOMPARE(spy.first().first().toString(), QString("foo!*@*"));
+    QCOMPARE(manager->ignores(), QStringList() << "bar!*@*");
+    QVERIFY(!manager->messageFilter(foo));
+}
+
+void tst_IgnoreManager::testSnapshot()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.path() + "/ignores.snapshot";
+
+    IgnoreManager* manager = IgnoreManager::instance();
+    const QStringList ignores = QStringList() << "foo!*@*" << "*!*@bar" << "*!baz@*" << "*!*@198.51.100.0/22" << "*x*!*@*";
+    manager->setIgnores(ignores);
+    QVERIFY(manager->saveSnapshot(fileName));
+
+    manager->setIgnores(QStringList());
+    QVERIFY(manager->loadSnapshot(fileName, ignores));
+    QCOMPARE(manager->ignores(), ignores);
+
+    QVERIFY(manager->messageFilter(IrcMessage::fromData(":foo!ident@host PRIVMSG #chan :hi", connection)));
+    QVERIFY(manager->messageFilter(IrcMessage::fromData(":nick!ident@bar PRIVMSG #chan :hi", connection)));
+    QVERIFY(manager->messageFilter(IrcMessage::fromData(":nick!baz@host PRIVMSG #chan :hi", connection)));
+    QVERIFY(manager->messageFilter(IrcMessage::fromData(":nick!ident@198.51.101.1 PRIVMSG #chan :hi", connection)));
+    QVERIFY(manager->messageFilter(IrcMessage::fromData(":xyz!ident@host PRIVMSG #chan :hi", connection)));
+    QVERIFY(!manager->messageFilter(IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :hi", connection)));
+
+    // unmasked, as users type them
+    const QStringList raw = QStringList() << "foo" << "*!*@bar" << "*!baz@*" << "*!*@198.51.100.0/22" << "*x*" << "foo";
+    manager->setIgnores(QStringList());
+    QVERIFY(manager->loadSnapshot(fileName, raw));
+    QCOMPARE(manager->ignores(), ignores);
+
+    // stale
+    const QStringList changed = QStringList(ignores) << "qux!*@*";
+    QVERIFY(!manager->loadSnapshot(fileName, changed));
+    QCOMPARE(manager->ignores(), changed);
+
+    // corrupt
+    QFile file(fileName);
+    QVERIFY(file.open(QFile::ReadWrite));
+    file.seek(file.size() - 8);
+    file.write("garbage!");
+    file.close();
+    QVERIFY(!manager->loadSnapshot(fileName, ignores));
+    QCOMPARE(manager->ignores(), ignores);
+
+    // missing
+    QVERIFY(!manager->loadSnapshot(dir.path() + "/missing", ignores));
+    QCOMPARE(manager->ignores(), ignores);
+}
+
+void tst_IgnoreManager::testContentRules_data()
+{
+    QTest::addColumn<QStringList>("rules");
+    QTest::addColumn<uint>("types");
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("ignored");
+
+    const uint defaults = IgnoreManager::DefaultContentTypes;
+    const uint quits = 1u << IrcMessage::Quit;
+
+    QTest::newRow("none") << QStringList() << defaults << QByteArray(":nick!ident@host PRIVMSG #chan :hi") << false;
+    QTest::newRow("url") << (QStringList() << "spam.example.com") << defaults << QByteArray(":nick!ident@host PRIVMSG #chan :visit http://SPAM.example.com/now") << true;
+    QTest::newRow("overlap") << (QStringList() << "he" << "she" << "hers") << defaults << QByteArray(":nick!ident@host NOTICE #chan :ushers") << true;
+    QTest::newRow("suffix") << (QStringList() << "abcd" << "bc") << defaults << QByteArray(":nick!ident@host PRIVMSG #chan :xabcx") << true;
+    QTest::newRow("miss") << (QStringList() << "abcd" << "bcx") << defaults << QByteArray(":nick!ident@host PRIVMSG #chan :abce") << false;
+    QTest::newRow("wrong type") << (QStringList() << "bye") << defaults << QByteArray(":nick!ident@host QUIT :bye bye") << false;
+    QTest::newRow("quit") << (QStringList() << "bye") << quits << QByteArray(":nick!ident@host QUIT :bye bye") << true;
+    QTest::newRow("quit only") << (QStringList() << "bye") << quits << QByteArray(":nick!ident@host PRIVMSG #chan :bye") << false;
+}
+
+void tst_IgnoreManager::testContentRules()
+{
+    QFETCH(QStringList, rules);
+    QFETCH(uint, types);
+    QFETCH(QByteArray, data);
+    QFETCH(bool, ignored);
+
+    IgnoreManager* manager = IgnoreManager::instance();
+    foreach (const QString& rule, rules)
+        manager->addContentRule(rule, types);
+
+    IrcMessage* message = IrcMessage::fromData(data, connection);
+    QVERIFY(message);
+    QCOMPARE(manager->messageFilter(message), ignored);
+    QCOMPARE(manager->contentRules(), rules);
+
+    manager->clearContentRules();
+    QVERIFY(!manager->messageFilter(message));
+}
+
+void tst_IgnoreManager::testContentRuleChanges()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    for (int i = 0; i < 1000; ++i)
+        manager->addContentRule("spam" + QString::number(i));
+    QCOMPARE(manager->contentRules().count(), 1000);
+
+    IrcMessage* spam = IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :buy spam500 now", connection);
+    IrcMessage* quit = IrcMessage::fromData(":nick!ident@host QUIT :spam999", connection);
+    QVERIFY(manager->messageFilter(spam));
+    QVERIFY(!manager->messageFilter(quit));
+
+    // "spam50" is a prefix of "spam500" and still matches
+    manager->removeContentRule("spam500");
+    QVERIFY(manager->messageFilter(spam));
+    manager->removeContentRule("spam50");
+    manager->removeContentRule("spam5");
+    QVERIFY(!manager->messageFilter(spam));
+    QCOMPARE(manager->contentRules().count(), 997);
+    QCOMPARE(manager->contentRuleTypes("spam999"), uint(IgnoreManager::DefaultContentTypes));
+
+    // changing the types of a rule
+    manager->addContentRule("spam999", 1u << IrcMessage::Quit);
+    QCOMPARE(manager->contentRuleTypes("spam999"), 1u << IrcMessage::Quit);
+    QVERIFY(manager->messageFilter(quit));
+
+    manager->clearContentRules();
+    QVERIFY(!manager->messageFilter(quit));
+}
+
+void tst_IgnoreManager::testUpdate()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    IrcMessage* nick = IrcMessage::fromData(":nick500!ident@host PRIVMSG #chan :hi", connection);
+    IrcMessage* spam = IrcMessage::fromData(":other!ident@host PRIVMSG #chan :buy spam now", connection);
+    QVERIFY(!manager->messageFilter(nick));
+
+    // nothing is published before the outermost commit
+    manager->beginUpdate();
+    for (int i = 0; i < 1000; ++i)
+        manager->addIgnore("nick" + QString::number(i));
+    manager->beginUpdate();
+    manager->removeIgnore("nick0");
+    manager->addContentRule("spam");
+    manager->commitUpdate();
+    QVERIFY(manager->ignores().isEmpty());
+    QVERIFY(manager->contentRules().isEmpty());
+    QVERIFY(!manager->messageFilter(nick));
+    QVERIFY(!manager->messageFilter(spam));
+    manager->commitUpdate();
+
+    // the cached verdict of the prefix is gone too
+    QCOMPARE(manager->ignores().count(), 999);
+    QVERIFY(!manager->ignores().contains("nick0!*@*"));
+    QCOMPARE(manager->contentRules(), QStringList() << "spam");
+    QVERIFY(manager->messageFilter(nick));
+    QVERIFY(manager->messageFilter(spam));
+
+    QTest::ignoreMessage(QtWarningMsg, "IgnoreManager::commitUpdate(): no update in progress");
+    manager->commitUpdate();
+    manager->clearContentRules();
+}
+
+void tst_IgnoreManager::testBenchmark_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<bool>("cached");
+
+    QTest::newRow("10 masks") << 10 << false;
+    QTest::newRow("1k masks") << 1000 << false;
+    QTest::newRow("10k masks") << 10000 << false;
+    QTest::newRow("100k masks") << 100000 << false;
+    QTest::newRow("10k masks cached") << 10000 << true;
+}
+
+void tst_IgnoreManager::testBenchmark()
+{
+    QFETCH(int, count);
+    QFETCH(bool, cached);
+
+    IgnoreManager::instance()->setCacheSize(cached ? 1024 : 0);
+
+    QStringList ignores;
+    for (int i = 0; i < count; ++i) {
+        switch (i % 4) {
+            case 0: ignores += QString("spammer%1").arg(i); break;
+            case 1: ignores += QString("*!*@host%1.example.com").arg(i); break;
+            case 2: ignores += QString("*!bot%1@*").arg(i); break;
+            default: ignores += QString("flood%1*!*@*.net%1").arg(i); break;
+        }
+    }
+    IgnoreManager::instance()->setIgnores(ignores);
+
+    // one QBENCHMARK iteration filters 1000 messages: divide the
+    // reported time per iteration into 1000 to get messages per msec
+    QList<IrcMessage*> messages;
+    for (int i = 0; i < 1000; ++i) {
+        const QByteArray prefix = QString("user%1!~user%1@client%1.example.org").arg(i).toUtf8();
+        messages += IrcMessage::fromData(":" + prefix + " PRIVMSG #channel :lorem ipsum dolor sit amet", connection);
+    }
+
+    QBENCHMARK {
+        foreach (IrcMessage* message, messages)
+            IgnoreManager::instance()->messageFilter(message);
+    }
+}
+
+void tst_IgnoreManager::testChangeBenchmark_data()
+{
+    QTest::addColumn<int>("count");
+
+    QTest::newRow("1k masks") << 1000;
+    QTest::newRow("10k masks") << 10000;
+    QTest::newRow("100k masks") << 100000;
+}
+
+// Every change outside beginUpdate() publishes a snapshot of its own.
+// The time per iteration should stay about flat across the rows, since
+// the snapshots share everything but the shards and the path they touch.
+void tst_IgnoreManager::testChangeBenchmark()
+{
+    QFETCH(int, count);
+
+    IgnoreManager* manager = IgnoreManager::instance();
+    QStringList ignores;
+    for (int i = 0; i < count; ++i) {
+        switch (i % 4) {
+            case 0: ignores += QString("spammer%1!*@*").arg(i); break;
+            case 1: ignores += QString("*!*@host%1.example.com").arg(i); break;
+            case 2: ignores += QString("*!*@10.%1.%2.%3/32").arg(i >> 16).arg(i >> 8 & 255).arg(i & 255); break;
+            default: ignores += QString("flood%1*!*@*.net%1").arg(i); break;
+        }
+    }
+    manager->setIgnores(ignores);
+
+    QBENCHMARK {
+        manager->addIgnore("changed");
+        manager->addIgnore("*!*@192.0.2.0/24");
+        manager->removeIgnore("changed");
+        manager->removeIgnore("*!*@192.0.2.0/24");
+    }
+    QCOMPARE(manager->ignores(), ignores);
+}
+
+void tst_IgnoreManager::testConcurrency()
+{
+    IgnoreManager* manager = IgnoreManager::instance();
+    manager->setIgnores(QStringList() << "nick0" << "*!*@host1");
+
+    QList<FilterThread*> threads;
+    for (int t = 0; t < 4; ++t) {
+        FilterThread* thread = new FilterThread;
+        for (int i = 0; i < 5000; ++i) {
+            const QByteArray prefix = QString("nick%1!ident@host%1").arg(i % 4).toUtf8();
+            thread->messages += IrcMessage::fromData(":" + prefix + " PRIVMSG #chan :hi", connection);
+        }
+        threads += thread;
+    }
+
+    // the ignores for nick0 and host1 stay in every published snapshot
+    foreach (FilterThread* thread, threads)
+        thread->start();
+    for (int i = 0; i < 200; ++i) {
+        manager->addIgnore(QString("other%1").arg(i));
+        manager->addContentRule(QString("rule%1").arg(i));
+    }
+    foreach (FilterThread* thread, threads) {
+        QVERIFY(thread->wait(30000));
+        QCOMPARE(thread->ignored, 2500);
+    }
+    manager->clearContentRules();
+    qDeleteAll(threads);
+}
+
+void tst_IgnoreManager::testConcurrencyBenchmark_data()
+{
+    QTest::addColumn<int>("threadCount");
+
+    for (int count = 1; count <= qMax(4, QThread::idealThreadCount()); count *= 2)
+        QTest::newRow(qPrintable(QString("%1 threads").arg(count))) << count;
+}
+
+// Every row filters the same 100k messages, split over the threads. On
+// a machine with enough cores the time per iteration should drop with
+// the thread count, since readers share nothing but the snapshot.
+void tst_IgnoreManager::testConcurrencyBenchmark()
+{
+    QFETCH(int, threadCount);
+
+    QStringList ignores;
+    for (int i = 0; i < 10000; ++i)
+        ignores += QString(i % 2 ? "*!*@host%1.example.com" : "spammer%1").arg(i);
+    IgnoreManager::instance()->setIgnores(ignores);
+
+    QList<FilterThread*> threads;
+    for (int t = 0; t < threadCount; ++t) {
+        FilterThread* thread = new FilterThread;
+        for (int i = t; i < 100000; i += threadCount) {
+            const QByteArray prefix = QString("user%1!~user%1@client%1.example.org").arg(i).toUtf8();
+            thread->messages += IrcMessage::fromData(":" + prefix + " PRIVMSG #channel :lorem ipsum dolor sit amet", connection);
+        }
+        threads += thread;
+    }
+
+    QBENCHMARK {
+        foreach (FilterThread* thread, threads)
+            thread->start();
+        foreach (FilterThread* thread, threads)
+            thread->wait();
+    }
+    qDeleteAll(threads);
+}
+
+QTEST_MAIN(tst_IgnoreManager)
+
+#include "tst_ignoremanager.moc"
@@ -0,0 +1,7 @@
+######################################################################
+# Communi
+######################################################################
+
+SOURCES += tst_latencyrecorder.cpp
+
+include(../tests.pri)
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2008-2016 The Communi Project
+ *
+ * This test is free, and not covered by the BSD license. There is no
+ * restriction applied to their modification, redistribution, using and so on.
+ * You can study them, modify them, use them in your own program - either
+ * completely or partially.
+ */
+
+#include "latencyrecorder.h"
+#include "ignoremanager.h"
+#include <IrcConnection>
+#include <IrcMessage>
+#include <QtTest/QtTest>
+
+class tst_LatencyRecorder : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void cleanup();
+
+    void testBuckets_data();
+    void testBuckets();
+    void testSnapshot();
+    void testDisabled();
+    void testInstrumentation();
+    void testDump();
+};
+
+void tst_LatencyRecorder::cleanup()
+{
+    LatencyRecorder::instance()->setEnabled(false);
+    LatencyRecorder::instance()->setDumpInterval(0);
+    LatencyRecorder::instance()->reset();
+}
+
+void tst_LatencyRecorder::testBuckets_data()
+{
+    QTest::addColumn<qint64>("value");
+
+    QTest::newRow("0") << qint64(0);
+    QTest::newRow("7") << qint64(7);
+    QTest::newRow("8") << qint64(8);
+    QTest::newRow("100") << qint64(100);
+    QTest::newRow("1us") << qint64(1000);
+    QTest::newRow("1ms") << qint64(1000000);
+    QTest::newRow("1s") << qint64(1000000000);
+    QTest::newRow("1h") << Q_INT64_C(3600000000000);
+}
+
+void tst_LatencyRecorder::testBuckets()
+{
+    QFETCH(qint64, value);
+
+    const int bucket = LatencyRecorder::bucket(value);
+    QVERIFY(bucket >= 0 && bucket < LatencyRecorder::BucketCount);
+    if (value < (Q_INT64_C(1) << 41)) {
+        QVERIFY(LatencyRecorder::bucketValue(bucket) >= value);
+        QVERIFY(LatencyRecorder::bucketValue(bucket) - value <= value / 8);
+        QVERIFY(bucket == 0 || LatencyRecorder::bucketValue(bucket - 1) < value);
+    }
+}
+
+void tst_LatencyRecorder::testSnapshot()
+{
+    LatencyRecorder* recorder = LatencyRecorder::instance();
+    for (int i = 1; i <= 100; ++i)
+        recorder->record(LatencyRecorder::HandlerStage, IrcMessage::Private, i * 1000);
+    recorder->record(LatencyRecorder::HandlerStage, IrcMessage::Notice, 500000);
+
+    LatencyRecorder::Snapshot privates = recorder->snapshot(LatencyRecorder::HandlerStage, IrcMessage::Private);
+    QCOMPARE(privates.count, quint64(100));
+    QCOMPARE(privates.max, quint64(100000));
+    QCOMPARE(privates.mean(), qint64(50500));
+    QVERIFY(qAbs(privates.percentile(50) - 50000) <= 50000 / 8);
+    QVERIFY(qAbs(privates.percentile(99) - 99000) <= 99000 / 8);
+
+    LatencyRecorder::Snapshot all = recorder->snapshot(LatencyRecorder::HandlerStage);
+    QCOMPARE(all.count, quint64(101));
+    QCOMPARE(all.max, quint64(500000));
+    QCOMPARE(all.percentile(100), qint64(500000));
+
+    QCOMPARE(recorder->snapshot(LatencyRecorder::IgnoreStage).count, quint64(0));
+
+    recorder->reset();
+    QCOMPARE(recorder->snapshot(LatencyRecorder::HandlerStage).count, quint64(0));
+}
+
+void tst_LatencyRecorder::testDisabled()
+{
+    QVERIFY(!LatencyRecorder::isEnabled());
+    {
+        LatencyTimer timer(LatencyRecorder::HandlerStage, IrcMessage::Private);
+    }
+    QCOMPARE(LatencyRecorder::instance()->snapshot(LatencyRecorder::HandlerStage).count, quint64(0));
+
+    LatencyRecorder::instance()->setEnabled(true);
+    {
+        LatencyTimer timer(LatencyRecorder::HandlerStage, IrcMessage::Private);
+    }
+    QCOMPARE(LatencyRecorder::instance()->snapshot(LatencyRecorder::HandlerStage).count, quint64(1));
+}
+
+void tst_LatencyRecorder::testInstrumentation()
+{
+    IrcConnection connection;
+    IrcMessage* message = IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :hi", &connection);
+
+    IgnoreManager::instance()->messageFilter(message);
+    QCOMPARE(LatencyRecorder::instance()->snapshot(LatencyRecorder::IgnoreStage).count, quint64(0));
+
+    LatencyRecorder::instance()->setEnabled(true);
+    IgnoreManager::instance()->messageFilter(message);
+    QCOMPARE(LatencyRecorder::instance()->snapshot(LatencyRecorder::IgnoreStage, IrcMessage::Private).count, quint64(1));
+}
+
+void tst_LatencyRecorder::testDump()
+{
+    LatencyRecorder* recorder = LatencyRecorder::instance();
+    QVERIFY(recorder->dump().isEmpty());
+
+    recorder->record(LatencyRecorder::ZncFilterStage, IrcMessage::Batch, 1000);
+    QVERIFY(recorder->dump().contains("znc filter"));
+
+    QSignalSpy spy(recorder, SIGNAL(dumped(QString)));
+    recorder->setDumpInterval(100);
+    QTRY_VERIFY(spy.count() > 0);
+    QVERIFY(spy.first().first().toString().contains("znc filter"));
+}
+
+QTEST_MAIN(tst_LatencyRecorder)
+
+#include "tst_latencyrecorder.moc"
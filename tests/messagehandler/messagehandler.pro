@@ -0,0 +1,8 @@
+######################################################################
+# Communi
+######################################################################
+
+SOURCES += tst_messagehandler.cpp
+
+include(../tests.pri)
+include(../shared/shared.pri)
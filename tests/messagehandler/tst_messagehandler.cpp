@@ -0,0 +1,583 @@
+/*
+ * Copyright (C) 2008-2016 The Communi Project
+ *
+ * This test is free, and not covered by the BSD license. There is no
+ * restriction applied to their modification, redistribution, using and so on.
+ * You can study them, modify them, use them in your own program - either
+ * completely or partially.
+ */
+
+#include "messagehandler.h"
+#include "ignoremanager.h"
+#include "filterpipeline.h"
+#include "tst_ircclientserver.h"
+#include "tst_ircdata.h"
+#include <IrcConnection>
+#include <IrcBufferModel>
+#include <IrcBuffer>
+#include <IrcMessage>
+#include <Irc>
+#include <QtTest/QtTest>
+
+class TestMessageHandler : public MessageHandler
+{
+public:
+    using MessageHandler::handleMessage;
+};
+
+// the routing that MessageHandler::handleMessage() used to do, with its
+// "handled" dynamic property, kept as the baseline of the benchmark
+class LegacyRouter
+{
+public:
+    LegacyRouter(IrcBufferModel* model, IrcBuffer* defaultBuffer, IrcBuffer* currentBuffer)
+        : model(model), defaultBuffer(defaultBuffer), currentBuffer(currentBuffer) { }
+
+    void handleMessage(IrcMessage* message)
+    {
+        switch (message->type()) {
+            case IrcMessage::Motd:
+            {
+                sendMessage(message, defaultBuffer);
+                break;
+            }
+            case IrcMessage::Numeric:
+            {
+                IrcNumericMessage *numMsg = static_cast<IrcNumericMessage*>(message);
+
+                if (numMsg->code() == Irc::RPL_CHANNEL_URL)
+                    sendMessage(message, message->parameters().at(1));
+                else if (numMsg->code() < 300)
+                    sendMessage(message, defaultBuffer);
+                else
+                    sendMessage(message, currentBuffer);
+                break;
+            }
+            case IrcMessage::Notice:
+            {
+                if (message->prefix() == "ChanServ!ChanServ@services.") {
+                    QString content = static_cast<IrcNoticeMessage*>(message)->content();
+                    if (content.startsWith("[")) {
+                        int i = content.indexOf("]");
+                        if (i != -1) {
+                            QString title = content.mid(1, i - 1);
+                            sendMessage(message, title);
+                        }
+                    }
+                }
+                break;
+            }
+            default:
+            {
+                sendMessage(message, currentBuffer);
+                break;
+            }
+        }
+
+        if (!message->property("handled").isValid() || !message->property("handled").toBool()) {
+            sendMessage(message, currentBuffer);
+        }
+    }
+
+private:
+    void sendMessage(IrcMessage* message, IrcBuffer* buffer)
+    {
+        if (!buffer)
+            buffer = defaultBuffer;
+        if (buffer)
+            buffer->receiveMessage(message);
+
+        message->setProperty("handled", true);
+    }
+
+    void sendMessage(IrcMessage* message, const QString& bufferName)
+    {
+        sendMessage(message, model->find(bufferName));
+    }
+
+    IrcBufferModel* model;
+    IrcBuffer* defaultBuffer;
+    IrcBuffer* currentBuffer;
+};
+
+class tst_MessageHandler : public tst_IrcClientServer
+{
+    Q_OBJECT
+
+private slots:
+    void testRouting_data();
+    void testRouting();
+    void testRouteOverrides_data();
+    void testRouteOverrides();
+    void testCaseMapping();
+
+    void testCoalescing();
+    void testAggregation();
+    void testCollapsing();
+
+    void testBenchmark_data();
+    void testBenchmark();
+};
+
+void tst_MessageHandler::testRouting_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<QString>("buffer");
+
+    QTest::newRow("welcome") << QByteArray(":moorcock.freenode.net 001 communi :Welcome") << "server";
+    QTest::newRow("yourhost") << QByteArray(":moorcock.freenode.net 002 communi :Your host is moorcock.freenode.net") << "server";
+    QTest::newRow("motd numeric") << QByteArray(":moorcock.freenode.net 372 communi :- MOTD") << "current";
+    QTest::newRow("whois") << QByteArray(":moorcock.freenode.net 311 communi nick ident host * :real") << "current";
+    QTest::newRow("channel url") << QByteArray(":moorcock.freenode.net 328 communi #freenode :http://freenode.net") << "#freenode";
+    QTest::newRow("channel url case") << QByteArray(":moorcock.freenode.net 328 communi #FreeNode :http://freenode.net") << "#freenode";
+    QTest::newRow("channel url unknown") << QByteArray(":moorcock.freenode.net 328 communi #unknown :http://freenode.net") << "server";
+    QTest::newRow("chanserv") << QByteArray(":ChanServ!ChanServ@services. NOTICE communi :[#freenode] Welcome") << "#freenode";
+    QTest::newRow("chanserv other") << QByteArray(":ChanServ!ChanServ@services. NOTICE communi :Welcome") << "current";
+    QTest::newRow("notice") << QByteArray(":nick!ident@host NOTICE communi :hi") << "current";
+    QTest::newRow("chanserv rule") << QByteArray(":ChanServ!ChanServ@services.libera.chat NOTICE communi :[#FreeNode] Welcome") << "#freenode";
+    QTest::newRow("nickserv rule") << QByteArray(":NickServ!NickServ@services.libera.chat NOTICE communi :This nickname is registered.") << "server";
+    QTest::newRow("nickserv other") << QByteArray(":NickServ!NickServ@services.libera.chat NOTICE communi :You are now identified.") << "current";
+    QTest::newRow("nickserv unanchored") << QByteArray(":NickServ!NickServ@services.libera.chat NOTICE communi :Hi. This nickname is registered.") << "current";
+}
+
+void tst_MessageHandler::testRouting()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(QString, buffer);
+
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+    QVERIFY(waitForWritten(tst_IrcData::join("freenode")));
+
+    IrcBuffer* channel = model.find("#freenode");
+    QVERIFY(channel);
+    IrcBuffer* server = model.add("server");
+    IrcBuffer* current = model.add("current");
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setDefaultBuffer(server);
+    handler.setCurrentBuffer(current);
+    QVERIFY(handler.addServiceRule("ChanServ!ChanServ@services.libera.chat", "\\[([^\\]]+)\\]"));
+    QVERIFY(handler.addServiceRule("NickServ!NickServ@services.libera.chat", "This nickname is registered", "server"));
+    QVERIFY(!handler.addServiceRule("NickServ!NickServ@services.libera.chat", "no capture"));
+
+    QHash<QString, QSignalSpy*> spies;
+    spies.insert("#freenode", new QSignalSpy(channel, SIGNAL(messageReceived(IrcMessage*))));
+    spies.insert("server", new QSignalSpy(server, SIGNAL(messageReceived(IrcMessage*))));
+    spies.insert("current", new QSignalSpy(current, SIGNAL(messageReceived(IrcMessage*))));
+
+    IrcMessage* message = IrcMessage::fromData(data, connection);
+    QVERIFY(message);
+    handler.handleMessage(message);
+
+    foreach (const QString& key, spies.keys())
+        QCOMPARE(spies.value(key)->count(), key == buffer ? 1 : 0);
+    qDeleteAll(spies);
+}
+
+void tst_MessageHandler::testRouteOverrides_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<int>("code");
+    QTest::addColumn<int>("type");
+    QTest::addColumn<int>("route");
+    QTest::addColumn<int>("parameter");
+    QTest::addColumn<QString>("buffer");
+
+    // an empty buffer means the message was dropped
+    QTest::newRow("numeric default") << QByteArray(":moorcock.freenode.net 311 communi nick ident host * :real") << 311 << int(IrcMessage::Numeric) << int(MessageHandler::DefaultRoute) << 0 << "server";
+    QTest::newRow("numeric current") << QByteArray(":moorcock.freenode.net 002 communi :Your host") << 2 << int(IrcMessage::Numeric) << int(MessageHandler::CurrentRoute) << 0 << "current";
+    QTest::newRow("numeric drop") << QByteArray(":moorcock.freenode.net 372 communi :- MOTD") << 372 << int(IrcMessage::Numeric) << int(MessageHandler::DropRoute) << 0 << "";
+    QTest::newRow("numeric parameter") << QByteArray(":moorcock.freenode.net 367 communi #FreeNode *!*@host") << 367 << int(IrcMessage::Numeric) << int(MessageHandler::ParameterRoute) << 1 << "#freenode";
+    QTest::newRow("numeric parameter index") << QByteArray(":moorcock.freenode.net 441 communi nick #freenode :They aren't on that channel") << 441 << int(IrcMessage::Numeric) << int(MessageHandler::ParameterRoute) << 2 << "#freenode";
+    QTest::newRow("numeric parameter unknown") << QByteArray(":moorcock.freenode.net 441 communi nick #freenode :They aren't on that channel") << 441 << int(IrcMessage::Numeric) << int(MessageHandler::ParameterRoute) << 1 << "server";
+    QTest::newRow("numeric parameter missing") << QByteArray(":moorcock.freenode.net 441 communi nick #freenode :They aren't on that channel") << 441 << int(IrcMessage::Numeric) << int(MessageHandler::ParameterRoute) << 5 << "server";
+    QTest::newRow("type default") << QByteArray(":nick!ident@host NOTICE communi :hi") << -1 << int(IrcMessage::Notice) << int(MessageHandler::DefaultRoute) << 0 << "server";
+    QTest::newRow("type drop") << QByteArray(":nick!ident@host NOTICE communi :hi") << -1 << int(IrcMessage::Notice) << int(MessageHandler::DropRoute) << 0 << "";
+    QTest::newRow("type parameter") << QByteArray(":nick!ident@host PRIVMSG #freenode :hi") << -1 << int(IrcMessage::Private) << int(MessageHandler::ParameterRoute) << 0 << "#freenode";
+    QTest::newRow("type parameter index") << QByteArray(":nick!ident@host INVITE communi #FREENODE") << -1 << int(IrcMessage::Invite) << int(MessageHandler::ParameterRoute) << 1 << "#freenode";
+}
+
+void tst_MessageHandler::testRouteOverrides()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(int, code);
+    QFETCH(int, type);
+    QFETCH(int, route);
+    QFETCH(int, parameter);
+    QFETCH(QString, buffer);
+
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+    QVERIFY(waitForWritten(tst_IrcData::join("freenode")));
+
+    IrcBuffer* channel = model.find("#freenode");
+    QVERIFY(channel);
+    IrcBuffer* server = model.add("server");
+    IrcBuffer* current = model.add("current");
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setDefaultBuffer(server);
+    handler.setCurrentBuffer(current);
+
+    int actual = -1;
+    if (code != -1) {
+        handler.setNumericRoute(code, MessageHandler::Route(route), parameter);
+        QCOMPARE(int(handler.numericRoute(code, &actual)), route);
+    } else {
+        handler.setTypeRoute(IrcMessage::Type(type), MessageHandler::Route(route), parameter);
+        QCOMPARE(int(handler.typeRoute(IrcMessage::Type(type), &actual)), route);
+    }
+    QCOMPARE(actual, parameter);
+
+    QHash<QString, QSignalSpy*> spies;
+    spies.insert("#freenode", new QSignalSpy(channel, SIGNAL(messageReceived(IrcMessage*))));
+    spies.insert("server", new QSignalSpy(server, SIGNAL(messageReceived(IrcMessage*))));
+    spies.insert("current", new QSignalSpy(current, SIGNAL(messageReceived(IrcMessage*))));
+
+    IrcMessage* message = IrcMessage::fromData(data, connection);
+    QVERIFY(message);
+    QCOMPARE(int(message->type()), type);
+    handler.handleMessage(message);
+    delete message;
+
+    foreach (const QString& key, spies.keys())
+        QCOMPARE(spies.value(key)->count(), key == buffer ? 1 : 0);
+    qDeleteAll(spies);
+}
+
+void tst_MessageHandler::testCaseMapping()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    // the handler is attached after something else saw RPL_ISUPPORT
+    IgnoreManager::instance()->addConnection(connection);
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("ircnet")));
+    IgnoreManager::instance()->removeConnection(connection);
+
+    IrcBuffer* server = model.add("server");
+    IrcBuffer* query = model.add("foo[a]");
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setDefaultBuffer(server);
+
+    QSignalSpy serverSpy(server, SIGNAL(messageReceived(IrcMessage*)));
+    QSignalSpy querySpy(query, SIGNAL(messageReceived(IrcMessage*)));
+    auto route = [&](const QByteArray& data) {
+        IrcMessage* message = IrcMessage::fromData(data, connection);
+        handler.handleMessage(message);
+        delete message;
+    };
+
+    // ircnet uses ascii, which folds letters only
+    route(":irc.ifi.uio.no 328 communi FOO[A] :http://example.com");
+    QCOMPARE(querySpy.count(), 1);
+    route(":irc.ifi.uio.no 328 communi foo{a} :http://example.com");
+    QCOMPARE(querySpy.count(), 1);
+    QCOMPARE(serverSpy.count(), 1);
+
+    // a renamed buffer is found by its new title only
+    query->setName("bar[b]");
+    route(":irc.ifi.uio.no 328 communi BAR[B] :http://example.com");
+    QCOMPARE(querySpy.count(), 2);
+    route(":irc.ifi.uio.no 328 communi foo[a] :http://example.com");
+    QCOMPARE(querySpy.count(), 2);
+    QCOMPARE(serverSpy.count(), 2);
+
+    // a later RPL_ISUPPORT rebuilds the lookup
+    route(":irc.ifi.uio.no 005 communi CASEMAPPING=rfc1459 :are supported by this server");
+    serverSpy.clear();
+    route(":irc.ifi.uio.no 328 communi BAR{B} :http://example.com");
+    QCOMPARE(querySpy.count(), 3);
+    QCOMPARE(serverSpy.count(), 0);
+
+    // and is what the next handler starts with
+    TestMessageHandler other;
+    other.setModel(&model);
+    other.setDefaultBuffer(server);
+    IrcMessage* message = IrcMessage::fromData(":irc.ifi.uio.no 328 communi BAR{B} :http://example.com", connection);
+    other.handleMessage(message);
+    delete message;
+    QCOMPARE(querySpy.count(), 4);
+    QCOMPARE(serverSpy.count(), 0);
+}
+
+void tst_MessageHandler::testCoalescing()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    IrcBuffer* server = model.add("server");
+    IrcBuffer* current = model.add("current");
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setDefaultBuffer(server);
+    handler.setCurrentBuffer(current);
+    handler.setCoalescing(true);
+
+    QSignalSpy serverSpy(server, SIGNAL(messageReceived(IrcMessage*)));
+    QSignalSpy currentSpy(current, SIGNAL(messageReceived(IrcMessage*)));
+
+    // nothing receives batches, so nothing is queued
+    for (int i = 0; i < 3; ++i) {
+        IrcMessage* message = IrcMessage::fromData(":moorcock.freenode.net 002 communi :Your host", connection);
+        handler.handleMessage(message);
+        delete message;
+    }
+    IrcMessage* notice = IrcMessage::fromData(":nick!ident@host NOTICE communi :hi", connection);
+    handler.handleMessage(notice);
+    delete notice;
+
+    QCOMPARE(serverSpy.count(), 3);
+    QCOMPARE(currentSpy.count(), 1);
+
+    // one batch per buffer when the batch signal is connected
+    QSignalSpy batchSpy(&handler, SIGNAL(messagesReceived(IrcBuffer*,QList<IrcMessage*>)));
+    for (int i = 0; i < 3; ++i) {
+        IrcMessage* message = IrcMessage::fromData(":moorcock.freenode.net 002 communi :Your host", connection);
+        handler.handleMessage(message);
+        delete message;
+    }
+    notice = IrcMessage::fromData(":nick!ident@host NOTICE communi :hi", connection);
+    handler.handleMessage(notice);
+    delete notice;
+    QCOMPARE(batchSpy.count(), 0);
+
+    QTRY_COMPARE(batchSpy.count(), 2);
+    QCOMPARE(batchSpy.at(0).at(0).value<IrcBuffer*>(), server);
+    QCOMPARE(batchSpy.at(0).at(1).value<QList<IrcMessage*> >().count(), 3);
+    QCOMPARE(batchSpy.at(1).at(0).value<IrcBuffer*>(), current);
+    QCOMPARE(batchSpy.at(1).at(1).value<QList<IrcMessage*> >().count(), 1);
+    QCOMPARE(serverSpy.count(), 3);
+    QCOMPARE(currentSpy.count(), 1);
+
+    // hitting the limit flushes synchronously
+    handler.setCoalescingLimit(2);
+    for (int i = 0; i < 2; ++i) {
+        IrcMessage* message = IrcMessage::fromData(":moorcock.freenode.net 002 communi :Your host", connection);
+        handler.handleMessage(message);
+        delete message;
+    }
+    QCOMPARE(batchSpy.count(), 3);
+}
+
+void tst_MessageHandler::testAggregation()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    IrcBuffer* server = model.add("server");
+    IrcBuffer* current = model.add("current");
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setDefaultBuffer(server);
+    handler.setCurrentBuffer(current);
+    handler.setAggregating(true);
+    handler.setAggregationTimeout(50);
+
+    QSignalSpy batchSpy(&handler, SIGNAL(messagesReceived(IrcBuffer*,QList<IrcMessage*>)));
+
+    QList<QByteArray> lines;
+    lines << ":moorcock.freenode.net 321 communi Channel :Users  Name";
+    for (int i = 0; i < 100; ++i)
+        lines << ":moorcock.freenode.net 322 communi #chan" + QByteArray::number(i) + " 5 :topic";
+    lines << ":moorcock.freenode.net 323 communi :End of /LIST";
+
+    foreach (const QByteArray& line, lines) {
+        IrcMessage* message = IrcMessage::fromData(line, connection);
+        handler.handleMessage(message);
+        delete message;
+    }
+    QCOMPARE(batchSpy.count(), 1);
+    QCOMPARE(batchSpy.first().at(0).value<IrcBuffer*>(), current);
+    QCOMPARE(batchSpy.first().at(1).value<QList<IrcMessage*> >().count(), 102);
+
+    // a sequence without an end is delivered after the timeout
+    foreach (const QByteArray& line, lines.mid(0, 10)) {
+        IrcMessage* message = IrcMessage::fromData(line, connection);
+        handler.handleMessage(message);
+        delete message;
+    }
+    QCOMPARE(batchSpy.count(), 1);
+    QTRY_COMPARE(batchSpy.count(), 2);
+    QCOMPARE(batchSpy.last().at(1).value<QList<IrcMessage*> >().count(), 10);
+
+    // replies outside of a sequence are delivered on their own
+    IrcMessage* away = IrcMessage::fromData(":moorcock.freenode.net 301 communi nick :away", connection);
+    handler.handleMessage(away);
+    delete away;
+    QCOMPARE(batchSpy.count(), 3);
+    QCOMPARE(batchSpy.last().at(1).value<QList<IrcMessage*> >().count(), 1);
+}
+
+void tst_MessageHandler::testCollapsing()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+    QVERIFY(waitForWritten(tst_IrcData::join("freenode")));
+
+    IrcBuffer* channel = model.find("#freenode");
+    QVERIFY(channel);
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setStormThreshold(5);
+    handler.setStormWindow(60000);
+    handler.setCollapsing(true);
+
+    IrcBuffer* query = model.add("storm3");
+    QVERIFY(FilterPipeline::forConnection(connection)->stages().contains("storm"));
+
+    int joins = 0;
+    int quits = 0;
+    int collapsed = 0;
+    connect(channel, &IrcBuffer::messageReceived, [&](IrcMessage* message) {
+        if (message->type() == IrcMessage::Join)
+            ++joins;
+        else if (message->type() == IrcMessage::Quit)
+            ++quits;
+        if (MessageHandler::isCollapsed(message))
+            ++collapsed;
+    });
+    int queryQuits = 0;
+    connect(query, &IrcBuffer::messageReceived, [&](IrcMessage* message) {
+        if (message->type() == IrcMessage::Quit)
+            ++queryQuits;
+    });
+    QHash<IrcBuffer*, QList<QStringList> > storms;
+    QStringList reasons;
+    connect(&handler, &MessageHandler::stormCollapsed, [&](IrcBuffer* buffer, IrcMessage::Type, const QStringList& nicks, const QString& reason) {
+        storms[buffer] += nicks;
+        reasons += reason;
+    });
+
+    // the burst is delivered for the channel state, and the messages
+    // past the threshold are marked and summarized for the views
+    QByteArray burst;
+    for (int i = 0; i < 20; ++i)
+        burst += ":storm" + QByteArray::number(i) + "!u@h JOIN #freenode\r\n";
+    QVERIFY(waitForWritten(burst));
+    QCOMPARE(joins, 20);
+    QCOMPARE(collapsed, 15);
+
+    QTRY_COMPARE(storms.value(channel).count(), 1);
+    QCOMPARE(storms.value(channel).first().count(), 15);
+
+    // the channel is not refreshed, it saw every join
+    QTest::qWait(50);
+    QVERIFY(!serverSocket->readAll().contains("NAMES"));
+
+    QByteArray split;
+    for (int i = 0; i < 20; ++i)
+        split += ":storm" + QByteArray::number(i) + "!u@h QUIT :hub.example.net leaf.example.net\r\n";
+    QVERIFY(waitForWritten(split));
+    QCOMPARE(quits, 20);
+    QCOMPARE(collapsed, 35);
+
+    // the query of a nick that split gets its quit too
+    QCOMPARE(queryQuits, 1);
+
+    QTRY_COMPARE(storms.value(channel).count(), 2);
+    QCOMPARE(storms.value(channel).last().count(), 20);
+    QCOMPARE(storms.value(query), QList<QStringList>() << (QStringList() << "storm3"));
+    QCOMPARE(reasons.last(), QString("hub.example.net leaf.example.net"));
+
+    // a nick that split is marked when it comes back, other quits are not
+    QVERIFY(waitForWritten(":storm0!u@h JOIN #freenode\r\n:storm0!u@h QUIT :bye\r\n"));
+    QCOMPARE(quits, 21);
+    QCOMPARE(collapsed, 36);
+    QTRY_COMPARE(storms.value(channel).count(), 3);
+
+    // nicks that split are marked as a netjoin when they come back,
+    // even once the join burst is over
+    handler.setStormWindow(30000);
+    QVERIFY(waitForWritten(":storm1!u@h JOIN #freenode\r\n"));
+    QCOMPARE(joins, 22);
+    QCOMPARE(collapsed, 37);
+    QTRY_COMPARE(storms.value(channel).count(), 4);
+    QCOMPARE(storms.value(channel).last(), QStringList() << "storm1");
+}
+
+void tst_MessageHandler::testBenchmark_data()
+{
+    QTest::addColumn<QByteArray>("key");
+    QTest::addColumn<bool>("legacy");
+
+    // the "legacy" rows run the old routing code, for comparison
+    foreach (const QByteArray& key, tst_IrcData::keys()) {
+        QTest::newRow(key + " tracked") << key << false;
+        QTest::newRow(key + " legacy") << key << true;
+    }
+}
+
+void tst_MessageHandler::testBenchmark()
+{
+    QFETCH(QByteArray, key);
+    QFETCH(bool, legacy);
+
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome(key)));
+    QVERIFY(waitForWritten(tst_IrcData::join(key)));
+
+    TestMessageHandler handler;
+    handler.setModel(&model);
+    handler.setDefaultBuffer(model.add("server"));
+    handler.setCurrentBuffer(model.buffers().first());
+    LegacyRouter router(&model, handler.defaultBuffer(), handler.currentBuffer());
+
+    QList<QByteArray> lines;
+    foreach (const QByteArray& line, (tst_IrcData::welcome(key) + tst_IrcData::join(key)).split('\n')) {
+        if (!line.trimmed().isEmpty())
+            lines += line.trimmed();
+    }
+    QVERIFY(!lines.isEmpty());
+
+    // the messages are created anew in every iteration, so that the
+    // dynamic property is allocated for each of them like it used to be
+    QBENCHMARK {
+        foreach (const QByteArray& line, lines) {
+            IrcMessage* message = IrcMessage::fromData(line, connection);
+            if (legacy)
+                router.handleMessage(message);
+            else
+                handler.handleMessage(message);
+            delete message;
+        }
+    }
+}
+
+QTEST_MAIN(tst_MessageHandler)
+
+#include "tst_messagehandler.moc"
@@ -3,4 +3,10 @@
 ######################################################################
 
 TEMPLATE = subdirs
+SUBDIRS += filterpipeline
+SUBDIRS += floodmanager
+SUBDIRS += ignoremanager
+SUBDIRS += latencyrecorder
 SUBDIRS += messageformatter
+SUBDIRS += messagehandler
+SUBDIRS += zncmanager
@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2008-2016 The Communi Project
+ *
+ * This test is free, and not covered by the BSD license. There is no
+ * restriction applied to their modification, redistribution, using and so on.
+ * You can study them, modify them, use them in your own program - either
+ * completely or partially.
+ */
+
+#include "zncmanager.h"
+#include "ignoremanager.h"
+#include "latencyrecorder.h"
+#include "tst_ircclientserver.h"
+#include "tst_ircdata.h"
+#include <IrcBufferModel>
+#include <IrcBuffer>
+#include <IrcMessage>
+#include <QtTest/QtTest>
+
+static QByteArray playback(const QByteArray& channel, int count)
+{
+    QByteArray data = ":irc.znc.in BATCH +pb znc.in/playback " + channel + "\r\n";
+    for (int i = 0; i < count; ++i)
+        data += "@batch=pb :nick!ident@host PRIVMSG " + channel + " :line " + QByteArray::number(i) + "\r\n";
+    data += ":irc.znc.in BATCH -pb\r\n";
+    return data;
+}
+
+// the string splitting decoder that processMessage() used to be, kept
+// as the baseline of the benchmark
+static void legacyDecode(IrcPrivateMessage* message)
+{
+    if (message->nick() == "*buffextras") {
+        const QString msg = message->content();
+        const int idx = msg.indexOf(" ");
+        const QString prefix = msg.left(idx);
+        const QString content = msg.mid(idx + 1);
+
+        message->setPrefix(prefix);
+        if (content.startsWith("joined")) {
+            message->setTag("intent", "JOIN");
+            message->setParameters(QStringList() << message->target());
+        } else if (content.startsWith("parted")) {
+            message->setTag("intent", "PART");
+            QString reason = content.mid(content.indexOf("[") + 1);
+            reason.chop(1);
+            message->setParameters(QStringList() << message->target() << reason);
+        } else if (content.startsWith("quit")) {
+            message->setTag("intent", "QUIT");
+            QString reason = content.mid(content.indexOf("[") + 1);
+            reason.chop(1);
+            message->setParameters(QStringList() << reason);
+        } else if (content.startsWith("is")) {
+            message->setTag("intent", "NICK");
+            const QStringList tokens = content.split(" ", QString::SkipEmptyParts);
+            message->setParameters(QStringList() << tokens.last());
+        } else if (content.startsWith("set")) {
+            message->setTag("intent", "MODE");
+            QStringList tokens = content.split(" ", QString::SkipEmptyParts);
+            const QString user = tokens.takeLast();
+            const QString mode = tokens.takeLast();
+            message->setParameters(QStringList() << message->target() << mode << user);
+        } else if (content.startsWith("changed")) {
+            message->setTag("intent", "TOPIC");
+            const QString topic = content.mid(content.indexOf(":") + 2);
+            message->setParameters(QStringList() << message->target() << topic);
+        } else if (content.startsWith("kicked")) {
+            message->setTag("intent", "KICK");
+            QString reason = content.mid(content.indexOf("[") + 1);
+            reason.chop(1);
+            QStringList tokens = content.split(" ", QString::SkipEmptyParts);
+            message->setParameters(QStringList() << message->target() << tokens.value(1) << reason);
+        }
+    }
+}
+
+static const char* const buffExtras[] = {
+    "nick!ident@host joined",
+    "nick!ident@host parted with message: [see you]",
+    "nick!ident@host quit with message: [Ping timeout: 240 seconds]",
+    "nick is now known as nick_",
+    "ChanServ set mode: +o nick",
+    "nick changed the topic to: welcome to #chan",
+    "op kicked nick Reason: [behave]"
+};
+
+class TestZncManager : public ZncManager
+{
+public:
+    using ZncManager::processMessage;
+    using ZncManager::decodePlayback;
+};
+
+class tst_ZncManager : public tst_IrcClientServer
+{
+    Q_OBJECT
+
+private slots:
+    void testStreaming();
+    void testIgnores();
+    void testLatency();
+
+    void testBuffExtras_data();
+    void testBuffExtras();
+
+    void testBuffExtrasBenchmark_data();
+    void testBuffExtrasBenchmark();
+
+    void testParallelDecoding();
+
+    void testParallelDecodingBenchmark_data();
+    void testParallelDecodingBenchmark();
+
+    void testWatermarks();
+    void testPlaybackRequests();
+    void testLazyPlayback();
+
+private:
+    QList<IrcMessage*> buffExtrasPlayback(int count);
+};
+
+void tst_ZncManager::testStreaming()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    ZncManager znc;
+    znc.setModel(&model);
+    znc.setStreaming(true);
+    znc.setChunkSize(10);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    IrcBuffer* current = model.add("#current");
+    znc.setCurrentBuffer(current);
+
+    QStringList lines;
+    connect(current, &IrcBuffer::messageReceived, [&](IrcMessage* message) {
+        QVERIFY(message->flags() & IrcMessage::Playback);
+        lines += static_cast<IrcPrivateMessage*>(message)->content();
+    });
+    QSignalSpy started(&znc, SIGNAL(playbackStarted(IrcBuffer*,int)));
+    QSignalSpy progress(&znc, SIGNAL(playbackProgress(IrcBuffer*,int,int)));
+    QSignalSpy finished(&znc, SIGNAL(playbackFinished(IrcBuffer*)));
+
+    QVERIFY(waitForWritten(playback("#other", 15) + playback("#current", 25)));
+    QCOMPARE(started.count(), 2);
+    QVERIFY(lines.isEmpty());
+
+    QTRY_COMPARE(finished.count(), 2);
+    QCOMPARE(progress.count(), 5);
+
+    // the visible buffer goes first, in order
+    QCOMPARE(finished.first().first().value<IrcBuffer*>(), current);
+    QCOMPARE(lines.count(), 25);
+    QCOMPARE(lines.first(), QString("line 0"));
+    QCOMPARE(lines.at(9), QString("line 9"));
+    QCOMPARE(lines.at(10), QString("line 10"));
+    QCOMPARE(lines.last(), QString("line 24"));
+
+    QCOMPARE(progress.at(0).at(1).toInt(), 10);
+    QCOMPARE(progress.at(0).at(2).toInt(), 25);
+
+    // pending playback is dropped with the model
+    lines.clear();
+    QVERIFY(waitForWritten(playback("#current", 25)));
+    QCOMPARE(started.count(), 3);
+    int delivered = lines.count();
+    znc.setModel(0);
+    QTest::qWait(50);
+    QVERIFY(delivered < 25);
+    QCOMPARE(lines.count(), delivered);
+    QCOMPARE(finished.count(), 2);
+
+    // and with the connection
+    znc.setModel(&model);
+    lines.clear();
+    QVERIFY(waitForWritten(playback("#current", 25)));
+    QCOMPARE(started.count(), 4);
+    delivered = lines.count();
+    connection->close();
+    QTest::qWait(50);
+    QVERIFY(delivered < 25);
+    QCOMPARE(lines.count(), delivered);
+    QCOMPARE(finished.count(), 2);
+}
+
+void tst_ZncManager::testIgnores()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    ZncManager znc;
+    znc.setModel(&model);
+    IgnoreManager::instance()->setIgnores(QStringList() << "troll!*@*");
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    IrcBuffer* buffer = model.add("#chan");
+    QList<IrcMessage::Type> types;
+    QStringList lines;
+    connect(buffer, &IrcBuffer::messageReceived, [&](IrcMessage* message) {
+        types += message->type();
+        if (message->type() == IrcMessage::Private)
+            lines += static_cast<IrcPrivateMessage*>(message)->content();
+    });
+
+    // nothing ignored, the batch is delivered as is
+    QVERIFY(waitForWritten(playback("#chan", 3)));
+    QCOMPARE(types, QList<IrcMessage::Type>() << IrcMessage::Batch);
+
+    // the lines of the ignored user are dropped, its join is not
+    const QByteArray data = ":irc.znc.in BATCH +pb znc.in/playback #chan\r\n"
+                            "@batch=pb :nick!ident@host PRIVMSG #chan :first\r\n"
+                            "@batch=pb :troll!ident@host PRIVMSG #chan :spam\r\n"
+                            "@batch=pb :*buffextras!buffextras@znc.in PRIVMSG #chan :troll!ident@host joined\r\n"
+                            "@batch=pb :nick!ident@host PRIVMSG #chan :last\r\n"
+                            ":irc.znc.in BATCH -pb\r\n";
+    types.clear();
+    QVERIFY(waitForWritten(data));
+    QCOMPARE(lines.count(), 3);
+    QCOMPARE(lines.at(0), QString("first"));
+    QCOMPARE(lines.at(1), QString("troll!ident@host joined"));
+    QCOMPARE(lines.at(2), QString("last"));
+    QVERIFY(!types.contains(IrcMessage::Batch));
+
+    // with a receiver the remaining lines arrive at once
+    QList<int> batches;
+    QStringList prefixes;
+    connect(&znc, &ZncManager::messagesReceived, [&](IrcBuffer* target, const QList<IrcMessage*>& messages) {
+        QCOMPARE(target, buffer);
+        batches += messages.count();
+        foreach (IrcMessage* message, messages)
+            prefixes += message->prefix();
+    });
+    types.clear();
+    QVERIFY(waitForWritten(data));
+    QCOMPARE(batches, QList<int>() << 3);
+    QCOMPARE(prefixes, QStringList() << "nick!ident@host" << "troll!ident@host" << "nick!ident@host");
+    QVERIFY(types.isEmpty());
+
+    IgnoreManager::instance()->setIgnores(QStringList());
+}
+
+void tst_ZncManager::testLatency()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    ZncManager znc;
+    znc.setModel(&model);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    // a slow view is not blamed on the filter
+    IrcBuffer* buffer = model.add("#chan");
+    connect(buffer, &IrcBuffer::messageReceived, [](IrcMessage*) {
+        QThread::msleep(50);
+    });
+
+    LatencyRecorder* recorder = LatencyRecorder::instance();
+    recorder->reset();
+    recorder->setEnabled(true);
+    QVERIFY(waitForWritten(playback("#chan", 3)));
+    recorder->setEnabled(false);
+
+    const LatencyRecorder::Snapshot filter = recorder->snapshot(LatencyRecorder::ZncFilterStage, IrcMessage::Batch);
+    QCOMPARE(filter.count, quint64(1));
+    QVERIFY(filter.max < quint64(50000000));
+    QCOMPARE(recorder->snapshot(LatencyRecorder::IgnoreStage, IrcMessage::Batch).count, quint64(1));
+    recorder->reset();
+}
+
+void tst_ZncManager::testBuffExtras_data()
+{
+    QTest::addColumn<QString>("line");
+    QTest::addColumn<QString>("prefix");
+    QTest::addColumn<QString>("intent");
+    QTest::addColumn<QStringList>("params");
+
+    QTest::newRow("join") << buffExtras[0] << "nick!ident@host" << "JOIN" << (QStringList() << "#chan");
+    QTest::newRow("part") << buffExtras[1] << "nick!ident@host" << "PART" << (QStringList() << "#chan" << "see you");
+    QTest::newRow("quit") << buffExtras[2] << "nick!ident@host" << "QUIT" << (QStringList() << "Ping timeout: 240 seconds");
+    QTest::newRow("nick") << buffExtras[3] << "nick" << "NICK" << (QStringList() << "nick_");
+    QTest::newRow("mode") << buffExtras[4] << "ChanServ" << "MODE" << (QStringList() << "#chan" << "+o" << "nick");
+    QTest::newRow("topic") << buffExtras[5] << "nick" << "TOPIC" << (QStringList() << "#chan" << "welcome to #chan");
+    QTest::newRow("kick") << buffExtras[6] << "op" << "KICK" << (QStringList() << "#chan" << "nick" << "behave");
+    QTest::newRow("unknown") << "nick!ident@host waved" << "nick!ident@host" << QString() << (QStringList() << "#chan" << "nick!ident@host waved");
+}
+
+void tst_ZncManager::testBuffExtras()
+{
+    QFETCH(QString, line);
+    QFETCH(QString, prefix);
+    QFETCH(QString, intent);
+    QFETCH(QStringList, params);
+
+    TestZncManager znc;
+    IrcMessage* message = IrcMessage::fromData(":*buffextras!buffextras@znc.in PRIVMSG #chan :" + line.toUtf8(), connection);
+    QVERIFY(message);
+    znc.processMessage(static_cast<IrcPrivateMessage*>(message));
+
+    IrcMessage* legacy = IrcMessage::fromData(":*buffextras!buffextras@znc.in PRIVMSG #chan :" + line.toUtf8(), connection);
+    legacyDecode(static_cast<IrcPrivateMessage*>(legacy));
+
+    QCOMPARE(message->prefix(), prefix);
+    QCOMPARE(message->tags().value("intent").toString(), intent);
+    QCOMPARE(message->parameters(), params);
+    QCOMPARE(message->parameters(), legacy->parameters());
+
+    delete message;
+    delete legacy;
+}
+
+void tst_ZncManager::testBuffExtrasBenchmark_data()
+{
+    QTest::addColumn<bool>("legacy");
+
+    QTest::newRow("table") << false;
+    QTest::newRow("legacy") << true;
+}
+
+// Decodes a synthetic playback of 100k *buffextras lines. The messages
+// are rewritten by the decoder, so each run gets a fresh set.
+void tst_ZncManager::testBuffExtrasBenchmark()
+{
+    QFETCH(bool, legacy);
+
+    TestZncManager znc;
+    QList<IrcPrivateMessage*> messages;
+    for (int i = 0; i < 100000; ++i) {
+        const QByteArray line = ":*buffextras!buffextras@znc.in PRIVMSG #chan :" + QByteArray(buffExtras[i % 7]);
+        messages += static_cast<IrcPrivateMessage*>(IrcMessage::fromData(line, connection));
+    }
+    // decode the lazily parsed parts up front, outside of the measurement
+    foreach (IrcPrivateMessage* message, messages)
+        message->content();
+
+    QBENCHMARK_ONCE {
+        foreach (IrcPrivateMessage* message, messages) {
+            if (legacy)
+                legacyDecode(message);
+            else
+                znc.processMessage(message);
+        }
+    }
+    qDeleteAll(messages);
+}
+
+QList<IrcMessage*> tst_ZncManager::buffExtrasPlayback(int count)
+{
+    QList<IrcMessage*> messages;
+    for (int i = 0; i < count; ++i) {
+        const QByteArray line = ":*buffextras!buffextras@znc.in PRIVMSG #chan :" + QByteArray(buffExtras[i % 7]);
+        messages += IrcMessage::fromData(line, connection);
+    }
+    // left untouched, like the messages of a playback batch are
+    return messages;
+}
+
+void tst_ZncManager::testParallelDecoding()
+{
+    TestZncManager znc;
+    znc.setSliceSize(100);
+
+    QList<IrcMessage*> serial = buffExtrasPlayback(1050);
+    znc.decodePlayback(serial);
+
+    znc.setParallelDecoding(true);
+    QList<IrcMessage*> parallel = buffExtrasPlayback(1050);
+    parallel += IrcMessage::fromData(":nick!ident@host PRIVMSG #chan :not an extra", connection);
+    znc.decodePlayback(parallel);
+
+    QCOMPARE(parallel.count(), serial.count() + 1);
+    for (int i = 0; i < serial.count(); ++i) {
+        QVERIFY(parallel.at(i)->flags() & IrcMessage::Playback);
+        QCOMPARE(parallel.at(i)->prefix(), serial.at(i)->prefix());
+        QCOMPARE(parallel.at(i)->tags(), serial.at(i)->tags());
+        QCOMPARE(parallel.at(i)->parameters(), serial.at(i)->parameters());
+    }
+    QVERIFY(parallel.last()->flags() & IrcMessage::Playback);
+    QCOMPARE(parallel.last()->prefix(), QString("nick!ident@host"));
+
+    qDeleteAll(serial);
+    qDeleteAll(parallel);
+}
+
+void tst_ZncManager::testParallelDecodingBenchmark_data()
+{
+    QTest::addColumn<bool>("parallel");
+
+    QTest::newRow("serial") << false;
+    QTest::newRow("parallel") << true;
+}
+
+// Decodes a synthetic playback of 200k *buffextras lines in one batch.
+void tst_ZncManager::testParallelDecodingBenchmark()
+{
+    QFETCH(bool, parallel);
+
+    TestZncManager znc;
+    znc.setParallelDecoding(parallel);
+    QList<IrcMessage*> messages = buffExtrasPlayback(200000);
+
+    QBENCHMARK_ONCE {
+        znc.decodePlayback(messages);
+    }
+    qDeleteAll(messages);
+}
+
+void tst_ZncManager::testWatermarks()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.path() + "/playback.watermarks";
+
+    IrcBufferModel model;
+    model.setConnection(connection);
+
+    ZncManager znc;
+    znc.setModel(&model);
+    znc.setWatermarkFile(fileName);
+    QVERIFY(znc.watermarks().isEmpty());
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    QVERIFY(waitForWritten(":irc.znc.in BATCH +pb znc.in/playback #chan\r\n"
+                           "@batch=pb;time=2016-01-01T11:00:00.000Z :nick!ident@host PRIVMSG #chan :first\r\n"
+                           "@batch=pb;time=2016-01-01T12:00:00.250Z :nick!ident@host PRIVMSG #chan :last\r\n"
+                           ":irc.znc.in BATCH -pb\r\n"));
+    QVERIFY(waitForWritten("@time=2016-01-02T08:00:00.000Z :nick!ident@host PRIVMSG #other :live\r\n"));
+    model.add("#other");
+    QVERIFY(waitForWritten("@time=2016-01-02T09:00:00.000Z :nick!ident@host PRIVMSG #other :live\r\n"));
+
+    QCOMPARE(znc.watermark("#chan").toMSecsSinceEpoch(), Q_INT64_C(1451649600250));
+    QCOMPARE(znc.watermark("#other").toMSecsSinceEpoch(), Q_INT64_C(1451725200000));
+    QVERIFY(!znc.watermark("#missing").isValid());
+    QVERIFY(znc.saveWatermarks(fileName));
+
+    ZncManager restored;
+    restored.setWatermarkFile(fileName);
+    QStringList buffers = restored.watermarks();
+    buffers.sort();
+    QCOMPARE(buffers, QStringList() << "#chan" << "#other");
+    QCOMPARE(restored.watermark("#chan"), znc.watermark("#chan"));
+    QCOMPARE(restored.watermark("#other"), znc.watermark("#other"));
+
+    // corrupt
+    QFile file(fileName);
+    QVERIFY(file.open(QFile::ReadWrite));
+    file.seek(file.size() - 4);
+    file.write("junk");
+    file.close();
+    QVERIFY(!restored.loadWatermarks(fileName));
+    QCOMPARE(restored.watermark("#chan"), znc.watermark("#chan"));
+
+    // missing
+    QVERIFY(!restored.loadWatermarks(dir.path() + "/missing"));
+}
+
+void tst_ZncManager::testPlaybackRequests()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+    model.add("#old");
+
+    ZncManager znc;
+    znc.setModel(&model);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(":irc.znc.in CAP * LS :znc.in/playback\r\n"));
+    QVERIFY(waitForWritten(":irc.znc.in CAP * ACK :znc.in/playback\r\n"));
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    // without watermarks one wildcard request covers everything
+    QByteArray written;
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY * 0.000\r\nPING :znc.in/playback/*\r\n"));
+    QVERIFY(!written.contains("PLAY #old"));
+
+    // buffers added later are covered by the wildcard too
+    model.add("#new");
+    QVERIFY(waitForWritten(":irc.znc.in BATCH +pb znc.in/playback #played\r\n"
+                           "@batch=pb;time=2016-01-01T12:00:00.250Z :nick!ident@host PRIVMSG #played :missed\r\n"
+                           ":irc.znc.in BATCH -pb\r\n"));
+    QVERIFY(model.find("#played"));
+    QCOMPARE(znc.watermark("#played").toMSecsSinceEpoch(), Q_INT64_C(1451649600250));
+
+    // live messages do not move a watermark until the wildcard is answered
+    QVERIFY(waitForWritten("@time=2016-01-01T09:00:00.000Z :nick!ident@host PRIVMSG #new :live\r\n"));
+    QVERIFY(!znc.watermark("#new").isValid());
+    QVERIFY(waitForWritten(":irc.znc.in PONG irc.znc.in :znc.in/playback/*\r\n"));
+    QVERIFY(waitForWritten("@time=2016-01-01T10:00:00.000Z :nick!ident@host PRIVMSG #new :live\r\n"));
+    QCOMPARE(znc.watermark("#new").toMSecsSinceEpoch(), Q_INT64_C(1451642400000));
+    written += serverSocket->readAll();
+    QVERIFY(!written.contains("PLAY #new"));
+    QVERIFY(!written.contains("PLAY #played"));
+
+    // reconnecting asks for what was missed since the newest watermark,
+    // and the buffers that are further behind for the rest up to it
+    connection->close();
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(":irc.znc.in CAP * LS :znc.in/playback\r\n"));
+    QVERIFY(waitForWritten(":irc.znc.in CAP * ACK :znc.in/playback\r\n"));
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    written.clear();
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY * 1451649600.250\r\n"));
+    QVERIFY(written.contains("ZNC *playback PLAY #new 1451642400.000 1451649600.250\r\n"));
+    QVERIFY(written.contains("ZNC *playback PLAY #old 0.000 1451649600.250\r\n"));
+    QVERIFY(!written.contains("PLAY #played"));
+
+    // live messages do not move the watermark while the request is outstanding
+    QVERIFY(waitForWritten("@time=2016-01-02T08:00:00.000Z :nick!ident@host PRIVMSG #new :live\r\n"));
+    QCOMPARE(znc.watermark("#new").toMSecsSinceEpoch(), Q_INT64_C(1451642400000));
+    QVERIFY(waitForWritten(":irc.znc.in PONG irc.znc.in :znc.in/playback/#new\r\n"));
+    QVERIFY(waitForWritten(":irc.znc.in PONG irc.znc.in :znc.in/playback/#old\r\n"));
+    QVERIFY(waitForWritten(":irc.znc.in PONG irc.znc.in :znc.in/playback/*\r\n"));
+    QVERIFY(waitForWritten("@time=2016-01-02T09:00:00.000Z :nick!ident@host PRIVMSG #new :live\r\n"));
+    QCOMPARE(znc.watermark("#new").toMSecsSinceEpoch(), Q_INT64_C(1451725200000));
+
+    // what a buffer has seen is not delivered again
+    QStringList lines;
+    connect(model.find("#new"), &IrcBuffer::messageReceived, [&](IrcMessage* message) {
+        if (message->type() == IrcMessage::Private)
+            lines += static_cast<IrcPrivateMessage*>(message)->content();
+    });
+    QVERIFY(waitForWritten(":irc.znc.in BATCH +pb znc.in/playback #new\r\n"
+                           "@batch=pb;time=2016-01-02T08:00:00.000Z :nick!ident@host PRIVMSG #new :seen\r\n"
+                           ":irc.znc.in BATCH -pb\r\n"));
+    QVERIFY(lines.isEmpty());
+
+    // queries the client has never seen come with the wildcard
+    QVERIFY(waitForWritten(":irc.znc.in BATCH +pb znc.in/playback friend\r\n"
+                           "@batch=pb;time=2016-01-01T13:00:00.000Z :friend!ident@host PRIVMSG nick :hi\r\n"
+                           ":irc.znc.in BATCH -pb\r\n"));
+    QVERIFY(model.find("friend"));
+    QCOMPARE(znc.watermark("friend").toMSecsSinceEpoch(), Q_INT64_C(1451653200000));
+}
+
+void tst_ZncManager::testLazyPlayback()
+{
+    IrcBufferModel model;
+    model.setConnection(connection);
+    IrcBuffer* current = model.add("#current");
+    IrcBuffer* sticky = model.add("#sticky");
+    sticky->setSticky(true);
+    IrcBuffer* first = model.add("#first");
+    IrcBuffer* second = model.add("#second");
+    IrcBuffer* third = model.add("#third");
+
+    ZncManager znc;
+    znc.setModel(&model);
+    znc.setLazy(true);
+    znc.setMaxRequests(2);
+    znc.setCurrentBuffer(current);
+
+    connection->open();
+    QVERIFY(waitForOpened());
+    QVERIFY(waitForWritten(":irc.znc.in CAP * LS :znc.in/playback\r\n"));
+    QVERIFY(waitForWritten(":irc.znc.in CAP * ACK :znc.in/playback\r\n"));
+    QVERIFY(waitForWritten(tst_IrcData::welcome("freenode")));
+
+    QByteArray written;
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #sticky 0.000\r\n"));
+    QVERIFY(written.contains("ZNC *playback PLAY #current 0.000\r\n"));
+    QVERIFY(!written.contains("PLAY #first"));
+
+    // not played back yet, so live messages do not move the watermark
+    QVERIFY(waitForWritten("@time=2016-01-01T12:00:00.000Z :nick!ident@host PRIVMSG #first :live\r\n"));
+    QVERIFY(!znc.watermark("#first").isValid());
+
+    // both slots are taken
+    znc.fetchPlayback(first);
+    znc.fetchPlayback(second);
+    znc.setCurrentBuffer(third);
+    QVERIFY(waitForWritten(playback("#sticky", 1)));
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #third 0.000\r\n"));
+    QVERIFY(!written.contains("PLAY #first"));
+    QVERIFY(!written.contains("PLAY #second"));
+
+    QVERIFY(waitForWritten(playback("#current", 1)));
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #second 0.000\r\n"));
+    QVERIFY(!written.contains("PLAY #first"));
+
+    QVERIFY(waitForWritten(playback("#third", 1)));
+    // up to the first live message
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #first 0.000 1451649600.000\r\n"));
+
+    // each buffer is played back once per connection
+    znc.fetchPlayback(first);
+    znc.setCurrentBuffer(current);
+    // a server that plays back past the end does not duplicate the live line
+    QStringList lines;
+    connect(first, &IrcBuffer::messageReceived, [&](IrcMessage* message) {
+        if (message->type() == IrcMessage::Private)
+            lines += static_cast<IrcPrivateMessage*>(message)->content();
+    });
+    QVERIFY(waitForWritten(":irc.znc.in BATCH +pb znc.in/playback #first\r\n"
+                           "@batch=pb;time=2016-01-01T11:00:00.000Z :nick!ident@host PRIVMSG #first :missed\r\n"
+                           "@batch=pb;time=2016-01-01T12:00:00.000Z :nick!ident@host PRIVMSG #first :live\r\n"
+                           ":irc.znc.in BATCH -pb\r\n"));
+    QCOMPARE(lines, QStringList() << "missed");
+    written += serverSocket->readAll();
+    QCOMPARE(written.count("PLAY #first"), 1);
+    QCOMPARE(written.count("PLAY #current"), 1);
+    QVERIFY(znc.watermark("#first").isValid());
+
+    // a request without history completes on the PONG after it
+    IrcBuffer* fourth = model.add("#fourth");
+    IrcBuffer* fifth = model.add("#fifth");
+    znc.fetchPlayback(fourth);
+    znc.fetchPlayback(fifth);
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #fourth 0.000\r\n"));
+    QVERIFY(written.contains("PING :znc.in/playback/#second\r\n"));
+    QVERIFY(!written.contains("PLAY #fifth"));
+    QVERIFY(waitForWritten(":irc.znc.in PONG irc.znc.in :znc.in/playback/#second\r\n"));
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #fifth 0.000\r\n"));
+
+    // a request keeps its slot until it is answered
+    IrcBuffer* sixth = model.add("#sixth");
+    znc.fetchPlayback(sixth);
+    QTest::qWait(100);
+    written += serverSocket->readAll();
+    QVERIFY(!written.contains("PLAY #sixth"));
+    QVERIFY(waitForWritten(playback("#fifth", 1)));
+    QTRY_VERIFY((written += serverSocket->readAll()).contains("ZNC *playback PLAY #sixth 0.000\r\n"));
+}
+
+QTEST_MAIN(tst_ZncManager)
+
+#include "tst_zncmanager.moc"
@@ -0,0 +1,8 @@
+######################################################################
+# Communi
+######################################################################
+
+SOURCES += tst_zncmanager.cpp
+
+include(../tests.pri)
+include(../shared/shared.pri)
@@ -28,23 +28,72 @@
 
 #include "zncmanager.h"
 #include "ignoremanager.h"
+#include "filterpipeline.h"
+#include "latencyrecorder.h"
 #include <ircbuffermodel.h>
 #include <ircconnection.h>
 #include <irccommand.h>
 #include <ircmessage.h>
 #include <ircbuffer.h>
+#include <QTimerEvent>
+#include <QMetaMethod>
+#include <QSaveFile>
+#include <QFile>
+#include <QSemaphore>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QVector>
+#include <string.h>
 
 IRC_USE_NAMESPACE
 
+// changed watermarks are written at most this often
+static const int SaveDelay = 5000;
+
+// *playback sends nothing for a buffer without missed history, so each
+// request is followed by a PING with this prefix. ZNC answers it itself,
+// after the batch if there is one.
+static const QLatin1String PlaybackPing("znc.in/playback/");
+
+// *playback takes fractional seconds, so messages within the same
+// second as the watermark are not played back again
+static QString playTime(qint64 timestamp)
+{
+    return QString("%1.%2").arg(timestamp / 1000).arg(timestamp % 1000, 3, 10, QLatin1Char('0'));
+}
+
+// an end of -1 plays back up to now
+static QString playCommand(const QString& buffer, qint64 from, qint64 to)
+{
+    QString command = QString("ZNC *playback PLAY %1 %2").arg(buffer, playTime(from));
+    if (to != -1)
+        command += QLatin1Char(' ') + playTime(to);
+    return command;
+}
+
+// the buffer name of the wildcard request
+static const QLatin1String AllBuffers("*");
+
 ZncManager::ZncManager(QObject* parent) : QObject(parent)
 {
     d.model = 0;
-    d.timestamp = QDateTime::fromTime_t(0);
+    d.ignoring = false;
+    d.streaming = false;
+    d.chunkSize = 500;
+    d.parallel = false;
+    d.sliceSize = 2000;
+    d.lazy = false;
+    d.maxRequests = 4;
+    d.horizon = -1;
     setModel(qobject_cast<IrcBufferModel*>(parent));
 }
 
 ZncManager::~ZncManager()
 {
+    if (d.saveTimer.isActive())
+        saveWatermarks(d.watermarkFile);
+    clearPlaybacks();
 }
 
 IrcBufferModel* ZncManager::model() const
@@ -58,9 +107,17 @@ void ZncManager::setModel(IrcBufferModel* model)
         if (d.model && d.model->connection()) {
             IrcConnection* connection = d.model->connection();
             disconnect(connection, &IrcConnection::connected, this, &ZncManager::requestPlayback);
-            connection->removeMessageFilter(this);
-            disconnect(model, &IrcBufferModel::removed, this, &ZncManager::clearBuffer);
+            disconnect(connection, &IrcConnection::disconnected, this, &ZncManager::clearPlaybacks);
+            FilterPipeline::forConnection(connection)->removeStage(this);
+            if (d.ignoring)
+                IgnoreManager::instance()->removeConnection(connection);
+            d.ignoring = false;
+            disconnect(d.model, &IrcBufferModel::removed, this, &ZncManager::clearBuffer);
+            disconnect(d.model, &IrcBufferModel::added, this, &ZncManager::addBuffer);
+            foreach (IrcBuffer* buffer, d.model->buffers())
+                disconnect(buffer, &IrcBuffer::messageReceived, this, &ZncManager::updateWatermark);
         }
+        clearPlaybacks();
         d.model = model;
         if (d.model && d.model->connection()) {
             IrcNetwork* network = d.model->network();
@@ -77,94 +134,796 @@ void ZncManager::setModel(IrcBufferModel* model)
 
             IrcConnection* connection = d.model->connection();
             connect(connection, &IrcConnection::connected, this, &ZncManager::requestPlayback);
-            connection->installMessageFilter(this);
+            connect(connection, &IrcConnection::disconnected, this, &ZncManager::clearPlaybacks);
+            // playback batches are unpacked before the ignores see them
+            FilterPipeline* pipeline = FilterPipeline::forConnection(connection);
+            pipeline->insertStage(0, "znc", this);
+            // only the ignore stage added here is removed again
+            d.ignoring = !pipeline->contains(IgnoreManager::instance());
+            if (d.ignoring)
+                IgnoreManager::instance()->addConnection(connection);
             connect(model, &IrcBufferModel::removed, this, &ZncManager::clearBuffer);
+            connect(model, &IrcBufferModel::added, this, &ZncManager::addBuffer);
+            foreach (IrcBuffer* buffer, model->buffers())
+                connect(buffer, &IrcBuffer::messageReceived, this, &ZncManager::updateWatermark);
         }
         emit modelChanged(model);
     }
 }
 
+// Only the filter's own work is timed as the ZNC filter stage. Decoding
+// has a stage of its own and delivering belongs to the buffers.
 bool ZncManager::messageFilter(IrcMessage* message)
 {
-    IrcConnection* connection = message->connection();
-    if (connection->isConnected())
-        d.timestamp = qMax(d.timestamp, message->timeStamp());
+    IrcBatchMessage* batch = 0;
+    IrcBuffer* buffer = 0;
+    QList<IrcMessage*> messages;
+    {
+        const LatencyTimer timer(LatencyRecorder::ZncFilterStage, message->type());
+        if (message->type() == IrcMessage::Pong) {
+            // a request that had nothing to play back
+            const QString argument = message->parameters().value(message->parameters().count() - 1);
+            if (!argument.startsWith(PlaybackPing))
+                return false;
+            if (d.outstanding.remove(argument.mid(PlaybackPing.size())))
+                sendRequests();
+            return true;
+        }
+        if (message->type() != IrcMessage::Batch)
+            return false;
+        batch = static_cast<IrcBatchMessage*>(message);
+        if (batch->batch() != "znc.in/playback")
+            return false;
 
-    if (message->type() == IrcMessage::Batch) {
-        IrcBatchMessage* batch = static_cast<IrcBatchMessage*>(message);
-        if (batch->batch() == "znc.in/playback") {
-            IrcBuffer* buffer = d.model->add(batch->parameters().value(2));
-            foreach (IrcMessage* msg, batch->messages()) {
-                msg->setFlags(msg->flags() | IrcMessage::Playback);
-                if (msg->type() == IrcMessage::Private)
-                    processMessage(static_cast<IrcPrivateMessage*>(msg));
-            }
-            buffer->receiveMessage(batch);
+        // the buffer is being played back, adding it must not request it again
+        const QString title = batch->parameters().value(2);
+        d.requested.insert(title);
+        if (d.queued.remove(title))
+            d.queue.removeOne(title);
+        if (d.outstanding.remove(title))
+            sendRequests();
+
+        // what the buffer has already seen, before or live, is not
+        // delivered again; without server-time the repeats cannot be
+        // told apart
+        const qint64 seen = d.watermarks.value(title, -1);
+        const qint64 live = d.live.value(title, -1);
+        foreach (IrcMessage* msg, batch->messages()) {
+            const qint64 timestamp = msg->timeStamp().toMSecsSinceEpoch();
+            if (!msg->tags().contains("time") || (timestamp > seen && (live == -1 || timestamp < live)))
+                messages += msg;
+        }
+        if (messages.isEmpty())
+            return true;
+
+        buffer = d.model->add(title);
+        if (d.streaming) {
+            // the batch is gone once filtered, so the stream keeps copies
+            Playback playback;
+            playback.buffer = buffer;
+            foreach (IrcMessage* msg, messages)
+                playback.messages += msg->clone(this);
+            playback.front = 0;
+            d.playbacks += playback;
+            emit playbackStarted(buffer, playback.messages.count());
+            if (!d.timer.isActive())
+                d.timer.start(0, this);
             return true;
         }
     }
 
-    return IgnoreManager::instance()->messageFilter(message);
+    decodePlayback(messages);
+    // IrcBatchMessage cannot be rewritten, so when something was
+    // trimmed or ignored the remaining messages are delivered without it
+    messages = filterPlayback(messages);
+    if (messages.count() == batch->messages().count())
+        buffer->receiveMessage(batch);
+    else
+        deliver(buffer, messages);
+    return true;
+}
+
+bool ZncManager::isStreaming() const
+{
+    return d.streaming;
+}
+
+// In streaming mode playback batches are processed and delivered in
+// chunks of chunkSize messages, one chunk per event loop iteration.
+// The current buffer is finished first. Views append what they receive,
+// so the chunks of each buffer are delivered oldest first.
+void ZncManager::setStreaming(bool streaming)
+{
+    d.streaming = streaming;
+}
+
+int ZncManager::chunkSize() const
+{
+    return d.chunkSize;
+}
+
+void ZncManager::setChunkSize(int size)
+{
+    d.chunkSize = qMax(1, size);
+}
+
+IrcBuffer* ZncManager::currentBuffer() const
+{
+    return d.currentBuffer;
+}
+
+void ZncManager::setCurrentBuffer(IrcBuffer* buffer)
+{
+    d.currentBuffer = buffer;
+    if (d.lazy && buffer)
+        fetchPlayback(buffer);
+}
+
+// Requests the missed history of a buffer that has not been played back
+// since connecting, ahead of other pending requests. Views call this
+// when a buffer is scrolled to the top.
+void ZncManager::fetchPlayback(IrcBuffer* buffer)
+{
+    IrcConnection* connection = d.model ? d.model->connection() : 0;
+    if (buffer && connection && connection->isConnected() && d.model->network()->isCapable("znc.in/playback"))
+        requestBuffer(buffer->title(), true);
+}
+
+bool ZncManager::isLazy() const
+{
+    return d.lazy;
+}
+
+// In lazy mode only the current and sticky buffers are played back on
+// connect. The others are played back when they become current or are
+// passed to fetchPlayback(), with at most maxRequests PLAY requests in
+// flight at a time. Their watermarks stay put until then, so the live
+// messages in between do not hide the missed history, and the playback
+// ends at the first of them, so they are not shown twice. There is no
+// wildcard request, so queries the client has never seen are played
+// back once they are opened.
+void ZncManager::setLazy(bool lazy)
+{
+    d.lazy = lazy;
+}
+
+int ZncManager::maxRequests() const
+{
+    return d.maxRequests;
+}
+
+void ZncManager::setMaxRequests(int requests)
+{
+    d.maxRequests = qMax(1, requests);
+}
+
+bool ZncManager::isParallelDecoding() const
+{
+    return d.parallel;
+}
+
+// Playback messages are decoded independently of each other, so with
+// parallel decoding the text of the *buffextras lines of a batch of at
+// least two slices is decoded in slices of sliceSize lines on a thread
+// pool of the manager. The messages themselves are only touched by the
+// calling thread, which decodes slices as well and applies the results
+// before the batch is delivered, in its original order.
+void ZncManager::setParallelDecoding(bool parallel)
+{
+    d.parallel = parallel;
+}
+
+int ZncManager::sliceSize() const
+{
+    return d.sliceSize;
+}
+
+void ZncManager::setSliceSize(int size)
+{
+    d.sliceSize = qMax(1, size);
+}
+
+QDateTime ZncManager::watermark(const QString& buffer) const
+{
+    if (!d.watermarks.contains(buffer))
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(d.watermarks.value(buffer));
+}
+
+QStringList ZncManager::watermarks() const
+{
+    return d.watermarks.keys();
+}
+
+QString ZncManager::watermarkFile() const
+{
+    return d.watermarkFile;
+}
+
+// Loads the watermarks from the file and saves them back to it, a few
+// seconds after they have changed and when the manager is destroyed.
+void ZncManager::setWatermarkFile(const QString& fileName)
+{
+    if (d.watermarkFile != fileName) {
+        if (d.saveTimer.isActive()) {
+            d.saveTimer.stop();
+            saveWatermarks(d.watermarkFile);
+        }
+        d.watermarkFile = fileName;
+        if (!fileName.isEmpty())
+            loadWatermarks(fileName);
+    }
+}
+
+struct WatermarkHeader {
+    char magic[4];
+    quint32 version;
+    quint32 count;
+    quint32 size;
+    quint16 checksum;
+    quint16 reserved;
+};
+
+// each record is the msecs since epoch, the title length and its utf16 data
+static const char WatermarkMagic[4] = { 'C', 'Z', 'N', 'C' };
+static const quint32 WatermarkVersion = 1;
+
+// The file is replaced atomically, so a crash never leaves a half
+// written store behind and the previous watermarks remain valid.
+bool ZncManager::saveWatermarks(const QString& fileName) const
+{
+    QByteArray payload;
+    QHash<QString, qint64>::const_iterator it;
+    for (it = d.watermarks.constBegin(); it != d.watermarks.constEnd(); ++it) {
+        const qint64 timestamp = it.value();
+        const quint16 length = qMin(it.key().size(), 0xffff);
+        payload.append(reinterpret_cast<const char*>(&timestamp), sizeof(timestamp));
+        payload.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        payload.append(reinterpret_cast<const char*>(it.key().utf16()), length * sizeof(ushort));
+    }
+
+    WatermarkHeader header;
+    memcpy(header.magic, WatermarkMagic, sizeof(header.magic));
+    header.version = WatermarkVersion;
+    header.count = d.watermarks.count();
+    header.size = payload.size();
+    header.checksum = qChecksum(payload.constData(), payload.size());
+    header.reserved = 0;
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(payload);
+    return file.commit();
+}
+
+// Replaces the watermarks with the ones saved by saveWatermarks(). A
+// missing or damaged file leaves the current watermarks untouched.
+bool ZncManager::loadWatermarks(const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    const QByteArray data = file.readAll();
+    return loadWatermarks(data.constData(), data.size());
+}
+
+bool ZncManager::loadWatermarks(const char* data, qint64 size)
+{
+    WatermarkHeader header;
+    if (size < qint64(sizeof(header)))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, WatermarkMagic, sizeof(header.magic)) || header.version != WatermarkVersion)
+        return false;
+    if (header.size != size - qint64(sizeof(header)))
+        return false;
+
+    const char* payload = data + sizeof(header);
+    if (header.checksum != qChecksum(payload, header.size))
+        return false;
+
+    QHash<QString, qint64> watermarks;
+    watermarks.reserve(header.count);
+    qint64 offset = 0;
+    while (offset < header.size) {
+        qint64 timestamp;
+        quint16 length;
+        if (header.size - offset < qint64(sizeof(timestamp) + sizeof(length)))
+            return false;
+        memcpy(&timestamp, payload + offset, sizeof(timestamp));
+        memcpy(&length, payload + offset + sizeof(timestamp), sizeof(length));
+        offset += sizeof(timestamp) + sizeof(length);
+        if (header.size - offset < qint64(length * sizeof(ushort)))
+            return false;
+        QString title(length, Qt::Uninitialized);
+        memcpy(title.data(), payload + offset, length * sizeof(ushort));
+        offset += length * sizeof(ushort);
+        watermarks.insert(title, timestamp);
+    }
+    if (uint(watermarks.count()) != header.count)
+        return false;
+
+    d.watermarks = watermarks;
+    return true;
+}
+
+void ZncManager::timerEvent(QTimerEvent* event)
+{
+    if (event->timerId() == d.timer.timerId()) {
+        deliverChunk();
+    } else if (event->timerId() == d.saveTimer.timerId()) {
+        d.saveTimer.stop();
+        saveWatermarks(d.watermarkFile);
+    } else {
+        QObject::timerEvent(event);
+    }
+}
+
+void ZncManager::deliverChunk()
+{
+    int index = 0;
+    for (int i = 0; i < d.playbacks.count(); ++i) {
+        if (d.playbacks.at(i).buffer && d.playbacks.at(i).buffer == d.currentBuffer) {
+            index = i;
+            break;
+        }
+    }
+
+    Playback& playback = d.playbacks[index];
+    const QList<IrcMessage*> chunk = playback.messages.mid(playback.front, d.chunkSize);
+    playback.front += chunk.count();
+
+    decodePlayback(chunk);
+    if (playback.buffer)
+        deliver(playback.buffer, filterPlayback(chunk));
+    qDeleteAll(chunk);
+
+    const int total = playback.messages.count();
+    const int delivered = playback.front;
+    const bool finished = delivered == total;
+    IrcBuffer* buffer = playback.buffer;
+    if (finished)
+        d.playbacks.removeAt(index);
+    if (d.playbacks.isEmpty())
+        d.timer.stop();
+
+    if (buffer) {
+        emit playbackProgress(buffer, delivered, total);
+        if (finished)
+            emit playbackFinished(buffer);
+    }
+}
+
+// Playback that has not been delivered when the model or the connection
+// goes away is dropped.
+void ZncManager::clearPlaybacks()
+{
+    d.timer.stop();
+    foreach (const Playback& playback, d.playbacks)
+        qDeleteAll(playback.messages.mid(playback.front));
+    d.playbacks.clear();
+}
+
+// Decoded *buffextras lines stand for joins, parts, quits and the like.
+// Ignores do not hide those when they happen live either, so only the
+// other lines go through the ignores.
+QList<IrcMessage*> ZncManager::filterPlayback(const QList<IrcMessage*>& messages) const
+{
+    // one sample per batch, next to the ignores of live messages
+    const LatencyTimer timer(LatencyRecorder::IgnoreStage, IrcMessage::Batch);
+    static const QString intent = QStringLiteral("intent");
+    QList<IrcMessage*> lines;
+    lines.reserve(messages.count());
+    foreach (IrcMessage* msg, messages) {
+        if (!msg->tags().contains(intent))
+            lines += msg;
+    }
+
+    const QList<IrcMessage*> accepted = IgnoreManager::instance()->filterMessages(lines);
+    if (accepted.count() == lines.count())
+        return messages;
+
+    QList<IrcMessage*> filtered;
+    filtered.reserve(messages.count());
+    int next = 0;
+    foreach (IrcMessage* msg, messages) {
+        if (next < accepted.count() && accepted.at(next) == msg) {
+            filtered += msg;
+            ++next;
+        } else if (msg->tags().contains(intent)) {
+            filtered += msg;
+        }
+    }
+    return filtered;
+}
+
+// Playback that is not delivered as a batch goes to the receivers of
+// messagesReceived() at once, or else to the buffer one by one. The
+// messages are valid for the duration of the emission.
+void ZncManager::deliver(IrcBuffer* buffer, const QList<IrcMessage*>& messages)
+{
+    static const QMetaMethod signal = QMetaMethod::fromSignal(&ZncManager::messagesReceived);
+    if (isSignalConnected(signal)) {
+        qint64 timestamp = -1;
+        foreach (IrcMessage* msg, messages)
+            timestamp = qMax(timestamp, msg->timeStamp().toMSecsSinceEpoch());
+        advanceWatermark(buffer, timestamp, true);
+        emit messagesReceived(buffer, messages);
+    } else {
+        foreach (IrcMessage* msg, messages)
+            buffer->receiveMessage(msg);
+    }
+}
+
+// The *buffextras verbs, dispatched through a table on the verb token
+enum BuffExtra { Joined, Parted, Quit, Nick, Mode, Topic, Kicked, BuffExtraCount };
+
+static const struct {
+    const char* verb;
+    const char* intent;
+} buffExtras[BuffExtraCount] = {
+    { "joined", "JOIN" },
+    { "parted", "PART" },
+    { "quit", "QUIT" },
+    { "is", "NICK" },
+    { "set", "MODE" },
+    { "changed", "TOPIC" },
+    { "kicked", "KICK" }
+};
+
+static int buffExtra(const QStringRef& verb)
+{
+    for (int i = 0; i < BuffExtraCount; ++i) {
+        if (verb == QLatin1String(buffExtras[i].verb))
+            return i;
+    }
+    return -1;
+}
+
+// the text after the first '[' without the closing bracket
+static QString bracketed(const QString& msg, int from)
+{
+    const int bracket = msg.indexOf(QLatin1Char('['), from);
+    const int start = bracket == -1 ? from : bracket + 1;
+    return msg.mid(start, qMax(0, msg.size() - start - 1));
+}
+
+// the bounds of the last space separated token between from and to
+static int lastToken(const QString& msg, int from, int to, int* end)
+{
+    int e = to;
+    while (e > from && msg.at(e - 1) == QLatin1Char(' '))
+        --e;
+    *end = e;
+    return qMax(from, msg.lastIndexOf(QLatin1Char(' '), e - 1) + 1);
+}
+
+// A *buffextras line and what it decodes to. Decoding only reads and
+// writes plain strings, so it can run on any thread.
+struct ExtraLine {
+    QString content;
+    QString target;
+    QString prefix;
+    int extra;
+    QStringList params;
+};
+
+// Decodes lines such as "nick!ident@host parted with message: [reason]"
+// by walking the text in place. Only the strings that end up in the
+// message are allocated.
+static void decodeExtraLine(ExtraLine* line)
+{
+    const QString& msg = line->content;
+    line->extra = -1;
+    const int space = msg.indexOf(QLatin1Char(' '));
+    if (space == -1)
+        return;
+
+    const int from = space + 1;
+    int verbEnd = msg.indexOf(QLatin1Char(' '), from);
+    if (verbEnd == -1)
+        verbEnd = msg.size();
+
+    line->prefix = msg.left(space);
+    line->extra = buffExtra(msg.midRef(from, verbEnd - from));
+
+    QStringList& params = line->params;
+    switch (line->extra) {
+        case Joined:
+            params << line->target;
+            break;
+        case Parted:
+            params << line->target << bracketed(msg, from);
+            break;
+        case Quit:
+            params << bracketed(msg, from);
+            break;
+        case Nick: {
+            int end;
+            const int start = lastToken(msg, from, msg.size(), &end);
+            params << msg.mid(start, end - start);
+            break;
+        }
+        case Mode: {
+            int userEnd, modeEnd;
+            const int user = lastToken(msg, from, msg.size(), &userEnd);
+            const int mode = lastToken(msg, from, user, &modeEnd);
+            params << line->target << msg.mid(mode, modeEnd - mode) << msg.mid(user, userEnd - user);
+            break;
+        }
+        case Topic: {
+            const int colon = msg.indexOf(QLatin1Char(':'), from);
+            params << line->target << msg.mid(colon == -1 ? from + 1 : colon + 2);
+            break;
+        }
+        case Kicked: {
+            const int start = verbEnd + 1;
+            int end = msg.indexOf(QLatin1Char(' '), start);
+            if (end == -1)
+                end = msg.size();
+            params << line->target << msg.mid(start, qMax(0, end - start)) << bracketed(msg, from);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void applyExtraLine(IrcPrivateMessage* message, const ExtraLine& line)
+{
+    if (line.prefix.isNull())
+        return;
+    message->setPrefix(line.prefix);
+    if (line.extra == -1)
+        return;
+
+    static const QString intent = QStringLiteral("intent");
+    message->setTag(intent, QString(QLatin1String(buffExtras[line.extra].intent)));
+    message->setParameters(line.params);
 }
 
 void ZncManager::processMessage(IrcPrivateMessage* message)
 {
-    if (message->nick() == "*buffextras") {
-        const QString msg = message->content();
-        const int idx = msg.indexOf(" ");
-        const QString prefix = msg.left(idx);
-        const QString content = msg.mid(idx + 1);
-
-        message->setPrefix(prefix);
-        if (content.startsWith("joined")) {
-            message->setTag("intent", "JOIN");
-            message->setParameters(QStringList() << message->target());
-        } else if (content.startsWith("parted")) {
-            message->setTag("intent", "PART");
-            QString reason = content.mid(content.indexOf("[") + 1);
-            reason.chop(1);
-            message->setParameters(QStringList() << message->target() << reason);
-        } else if (content.startsWith("quit")) {
-            message->setTag("intent", "QUIT");
-            QString reason = content.mid(content.indexOf("[") + 1);
-            reason.chop(1);
-            message->setParameters(QStringList() << reason);
-        } else if (content.startsWith("is")) {
-            message->setTag("intent", "NICK");
-            const QStringList tokens = content.split(" ", QString::SkipEmptyParts);
-            message->setParameters(QStringList() << tokens.last());
-        } else if (content.startsWith("set")) {
-            message->setTag("intent", "MODE");
-            QStringList tokens = content.split(" ", QString::SkipEmptyParts);
-            const QString user = tokens.takeLast();
-            const QString mode = tokens.takeLast();
-            message->setParameters(QStringList() << message->target() << mode << user);
-        } else if (content.startsWith("changed")) {
-            message->setTag("intent", "TOPIC");
-            const QString topic = content.mid(content.indexOf(":") + 2);
-            message->setParameters(QStringList() << message->target() << topic);
-        } else if (content.startsWith("kicked")) {
-            message->setTag("intent", "KICK");
-            QString reason = content.mid(content.indexOf("[") + 1);
-            reason.chop(1);
-            QStringList tokens = content.split(" ", QString::SkipEmptyParts);
-            message->setParameters(QStringList() << message->target() << tokens.value(1) << reason);
+    const LatencyTimer timer(LatencyRecorder::ZncProcessStage, message->type());
+    if (message->nick() != QLatin1String("*buffextras"))
+        return;
+
+    ExtraLine line;
+    line.content = message->content();
+    line.target = message->target();
+    decodeExtraLine(&line);
+    applyExtraLine(message, line);
+}
+
+// The lines of one parallel decode. Slices are handed out in turn to
+// whoever asks first, the pool threads or the thread that waits for them.
+struct DecodeJob {
+    ExtraLine* lines;
+    int count;
+    int sliceSize;
+    int slices;
+    QAtomicInt next;
+    QSemaphore done;
+
+    void run()
+    {
+        for (int slice = next.fetchAndAddRelaxed(1); slice < slices; slice = next.fetchAndAddRelaxed(1)) {
+            const int end = qMin(count, (slice + 1) * sliceSize);
+            for (int i = slice * sliceSize; i < end; ++i)
+                decodeExtraLine(lines + i);
+            done.release();
         }
     }
+};
+
+// Holds on to the job, since it may only start once the job is done.
+class DecodeTask : public QRunnable
+{
+public:
+    explicit DecodeTask(const QSharedPointer<DecodeJob>& job) : job(job) { }
+    void run() { job->run(); }
+
+private:
+    QSharedPointer<DecodeJob> job;
+};
+
+void ZncManager::decodePlayback(const QList<IrcMessage*>& messages)
+{
+    if (!d.parallel || messages.count() < 2 * d.sliceSize) {
+        foreach (IrcMessage* msg, messages) {
+            msg->setFlags(msg->flags() | IrcMessage::Playback);
+            if (msg->type() == IrcMessage::Private)
+                processMessage(static_cast<IrcPrivateMessage*>(msg));
+        }
+        return;
+    }
+
+    // the messages belong to this thread and are only read and written
+    // here; the pool decodes copies of their text
+    QVector<IrcPrivateMessage*> extras;
+    QVector<ExtraLine> lines;
+    extras.reserve(messages.count());
+    lines.reserve(messages.count());
+    foreach (IrcMessage* msg, messages) {
+        msg->setFlags(msg->flags() | IrcMessage::Playback);
+        if (msg->type() == IrcMessage::Private && msg->nick() == QLatin1String("*buffextras")) {
+            IrcPrivateMessage* extra = static_cast<IrcPrivateMessage*>(msg);
+            ExtraLine line;
+            line.content = extra->content();
+            line.target = extra->target();
+            extras += extra;
+            lines += line;
+        }
+    }
+
+    QSharedPointer<DecodeJob> job(new DecodeJob);
+    job->lines = lines.data();
+    job->count = lines.count();
+    job->sliceSize = d.sliceSize;
+    job->slices = (lines.count() + d.sliceSize - 1) / d.sliceSize;
+    for (int i = 1; i < job->slices; ++i)
+        d.pool.start(new DecodeTask(job));
+
+    // this thread decodes too, and only waits for the slices in progress
+    job->run();
+    job->done.acquire(job->slices);
+
+    for (int i = 0; i < extras.count(); ++i)
+        applyExtraLine(extras.at(i), lines.at(i));
 }
 
+// Requests the missed history of each buffer that has a watermark, and
+// of each buffer in the model that has none.
+//
+// In eager mode the newest watermark is the horizon: the last time the
+// client saw anything. A wildcard request from the horizon brings in what
+// every buffer missed since, including queries the client has never seen.
+// Each buffer that is further behind asks for the rest up to the horizon,
+// so nothing is played back twice. Buffers that appear later were covered
+// by the wildcard.
+//
+// In lazy mode buffers that appear later are requested as they are added.
 void ZncManager::requestPlayback()
 {
+    d.requested.clear();
+    d.queue.clear();
+    d.queued.clear();
+    d.outstanding.clear();
+    d.live.clear();
+    d.horizon = -1;
     if (d.model->network()->isCapable("znc.in/playback")) {
-        IrcConnection* connection = d.model->connection();
-        connection->sendRaw(QString("ZNC *playback PLAY * %1").arg(d.timestamp.isValid() ? d.timestamp.toTime_t() : 0));
+        if (!d.lazy) {
+            d.horizon = 0;
+            foreach (qint64 watermark, d.watermarks)
+                d.horizon = qMax(d.horizon, watermark);
+        }
+        QStringList buffers = d.watermarks.keys();
+        foreach (IrcBuffer* buffer, d.model->buffers()) {
+            if (!d.watermarks.contains(buffer->title()))
+                buffers += buffer->title();
+        }
+        foreach (const QString& title, buffers) {
+            IrcBuffer* buffer = d.model->find(title);
+            if (d.lazy && (!buffer || (buffer != d.currentBuffer && !buffer->isSticky())))
+                continue;
+            if (!d.lazy && d.watermarks.value(title, 0) >= d.horizon)
+                d.requested.insert(title);
+            else
+                requestBuffer(title, buffer && buffer == d.currentBuffer);
+        }
+        if (!d.lazy) {
+            IrcConnection* connection = d.model->connection();
+            connection->sendRaw(playCommand(AllBuffers, d.horizon, -1));
+            connection->sendRaw(QString("PING :%1%2").arg(PlaybackPing, AllBuffers));
+            d.outstanding.insert(AllBuffers);
+        }
+    }
+}
+
+void ZncManager::requestBuffer(const QString& buffer, bool urgent)
+{
+    // *status and other module queries have no playback
+    if (buffer.isEmpty() || buffer.startsWith(QLatin1Char('*')))
+        return;
+    if (d.requested.contains(buffer)) {
+        if (urgent && d.queued.contains(buffer)) {
+            d.queue.removeOne(buffer);
+            d.queue.prepend(buffer);
+        }
+        return;
+    }
+    d.requested.insert(buffer);
+    d.queued.insert(buffer);
+    if (urgent)
+        d.queue.prepend(buffer);
+    else
+        d.queue.append(buffer);
+    sendRequests();
+}
+
+// Sends queued requests while there are free slots. Only lazy playback
+// is bounded; on connect the eager mode asks for everything at once.
+// A request is outstanding until its batch has ended, or until the PING
+// after it is answered when there was no batch.
+void ZncManager::sendRequests()
+{
+    IrcConnection* connection = d.model->connection();
+    while (!d.queue.isEmpty() && (!d.lazy || d.outstanding.count() < d.maxRequests)) {
+        const QString buffer = d.queue.takeFirst();
+        d.queued.remove(buffer);
+        // what arrived live is not asked for
+        qint64 to = d.live.value(buffer, -1);
+        if (d.horizon != -1 && (to == -1 || d.horizon < to))
+            to = d.horizon;
+        connection->sendRaw(playCommand(buffer, d.watermarks.value(buffer), to));
+        connection->sendRaw(QString("PING :%1").arg(PlaybackPing + buffer));
+        d.outstanding.insert(buffer);
     }
 }
 
+void ZncManager::addBuffer(IrcBuffer* buffer)
+{
+    connect(buffer, &IrcBuffer::messageReceived, this, &ZncManager::updateWatermark);
+    IrcConnection* connection = d.model->connection();
+    if (connection && connection->isConnected() && d.model->network()->isCapable("znc.in/playback")) {
+        if (d.lazy && (buffer == d.currentBuffer || buffer->isSticky()))
+            requestBuffer(buffer->title());
+    }
+}
+
+void ZncManager::updateWatermark(IrcMessage* message)
+{
+    qint64 timestamp = message->timeStamp().toMSecsSinceEpoch();
+    if (message->type() == IrcMessage::Batch) {
+        foreach (IrcMessage* msg, static_cast<IrcBatchMessage*>(message)->messages())
+            timestamp = qMax(timestamp, msg->timeStamp().toMSecsSinceEpoch());
+    }
+    const bool playback = message->type() == IrcMessage::Batch || message->flags() & IrcMessage::Playback;
+    advanceWatermark(qobject_cast<IrcBuffer*>(sender()), timestamp, playback);
+}
+
+void ZncManager::advanceWatermark(IrcBuffer* buffer, qint64 timestamp, bool playback)
+{
+    IrcConnection* connection = d.model ? d.model->connection() : 0;
+    if (!buffer || !connection || !connection->isConnected())
+        return;
+    // the history of a buffer that has not been played back yet starts
+    // at its current watermark, so live messages such as the JOIN echo
+    // after connecting must not move it until the request is answered
+    const QString title = buffer->title();
+    if (!playback && isFrozen(title)) {
+        // the playback ends where the live messages begin
+        if (!d.live.contains(title))
+            d.live.insert(title, timestamp);
+        return;
+    }
+
+    if (timestamp > d.watermarks.value(title, -1)) {
+        d.watermarks.insert(title, timestamp);
+        if (!d.watermarkFile.isEmpty() && !d.saveTimer.isActive())
+            d.saveTimer.start(SaveDelay, this);
+    }
+}
+
+bool ZncManager::isFrozen(const QString& title) const
+{
+    if (d.lazy && !d.requested.contains(title))
+        return true;
+    return d.queued.contains(title) || d.outstanding.contains(title) || d.outstanding.contains(AllBuffers);
+}
+
 void ZncManager::clearBuffer(IrcBuffer* buffer)
 {
+    if (d.queued.remove(buffer->title()))
+        d.queue.removeOne(buffer->title());
+    d.live.remove(buffer->title());
     if (d.model->network()->isCapable("znc.in/playback") && !buffer->title().contains("*")) {
         IrcConnection* connection = d.model->connection();
         connection->sendRaw(QString("ZNC *playback CLEAR %1").arg(buffer->title()));
     }
+    if (d.watermarks.remove(buffer->title()) && !d.watermarkFile.isEmpty() && !d.saveTimer.isActive())
+        d.saveTimer.start(SaveDelay, this);
 }
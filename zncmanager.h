@@ -31,6 +31,13 @@
 
 #include <QObject>
 #include <QDateTime>
+#include <QList>
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+#include <QPointer>
+#include <QBasicTimer>
+#include <QThreadPool>
 #include <IrcMessageFilter>
 #include "sharedglobal.h"
 
@@ -45,6 +52,14 @@ class SHARED_EXPORT ZncManager : public QObject, public IrcMessageFilter
     Q_OBJECT
     Q_INTERFACES(IrcMessageFilter)
     Q_PROPERTY(IrcBufferModel* model READ model WRITE setModel NOTIFY modelChanged)
+    Q_PROPERTY(bool streaming READ isStreaming WRITE setStreaming)
+    Q_PROPERTY(int chunkSize READ chunkSize WRITE setChunkSize)
+    Q_PROPERTY(IrcBuffer* currentBuffer READ currentBuffer WRITE setCurrentBuffer)
+    Q_PROPERTY(bool parallelDecoding READ isParallelDecoding WRITE setParallelDecoding)
+    Q_PROPERTY(int sliceSize READ sliceSize WRITE setSliceSize)
+    Q_PROPERTY(QString watermarkFile READ watermarkFile WRITE setWatermarkFile)
+    Q_PROPERTY(bool lazy READ isLazy WRITE setLazy)
+    Q_PROPERTY(int maxRequests READ maxRequests WRITE setMaxRequests)
 
 public:
     explicit ZncManager(QObject* parent = 0);
@@ -55,20 +70,100 @@ public:
 
     bool messageFilter(IrcMessage* message);
 
+    bool isStreaming() const;
+    void setStreaming(bool streaming);
+
+    int chunkSize() const;
+    void setChunkSize(int size);
+
+    IrcBuffer* currentBuffer() const;
+
+    bool isParallelDecoding() const;
+    void setParallelDecoding(bool parallel);
+
+    int sliceSize() const;
+    void setSliceSize(int size);
+
+    QDateTime watermark(const QString& buffer) const;
+    QStringList watermarks() const;
+
+    QString watermarkFile() const;
+    void setWatermarkFile(const QString& fileName);
+
+    bool saveWatermarks(const QString& fileName) const;
+    bool loadWatermarks(const QString& fileName);
+
+    bool isLazy() const;
+    void setLazy(bool lazy);
+
+    int maxRequests() const;
+    void setMaxRequests(int requests);
+
+public slots:
+    void setCurrentBuffer(IrcBuffer* buffer);
+    void fetchPlayback(IrcBuffer* buffer);
+
 signals:
     void modelChanged(IrcBufferModel* model);
 
+    void playbackStarted(IrcBuffer* buffer, int total);
+    void playbackProgress(IrcBuffer* buffer, int delivered, int total);
+    void playbackFinished(IrcBuffer* buffer);
+
+    void messagesReceived(IrcBuffer* buffer, const QList<IrcMessage*>& messages);
+
 protected:
     void processMessage(IrcPrivateMessage* message);
+    void decodePlayback(const QList<IrcMessage*>& messages);
+    void timerEvent(QTimerEvent* event);
 
 private slots:
     void requestPlayback();
     void clearBuffer(IrcBuffer* buffer);
+    void addBuffer(IrcBuffer* buffer);
+    void updateWatermark(IrcMessage* message);
+    void clearPlaybacks();
 
 private:
+    void deliverChunk();
+    QList<IrcMessage*> filterPlayback(const QList<IrcMessage*>& messages) const;
+    void deliver(IrcBuffer* buffer, const QList<IrcMessage*>& messages);
+    void advanceWatermark(IrcBuffer* buffer, qint64 timestamp, bool playback);
+    bool isFrozen(const QString& title) const;
+    void requestBuffer(const QString& buffer, bool urgent = false);
+    void sendRequests();
+    bool loadWatermarks(const char* data, qint64 size);
+
+    // a streamed playback batch; the messages are delivered in chunks
+    // from the front
+    struct Playback {
+        QPointer<IrcBuffer> buffer;
+        QList<IrcMessage*> messages;
+        int front;
+    };
+
     mutable struct Private {
-        QDateTime timestamp;
         IrcBufferModel* model;
+        bool ignoring;
+        bool streaming;
+        int chunkSize;
+        QPointer<IrcBuffer> currentBuffer;
+        QList<Playback> playbacks;
+        QBasicTimer timer;
+        bool parallel;
+        int sliceSize;
+        QThreadPool pool;
+        QHash<QString, qint64> watermarks;
+        QSet<QString> requested;
+        QString watermarkFile;
+        QBasicTimer saveTimer;
+        bool lazy;
+        int maxRequests;
+        QStringList queue;
+        QSet<QString> queued;
+        QSet<QString> outstanding;
+        qint64 horizon;
+        QHash<QString, qint64> live;
     } d;
 };
 